@@ -1,4 +1,6 @@
 #include <algorithm>
+#include <numeric>
+#include <sstream>
 #include <vector>
 
 #include "Symulator.h"
@@ -10,101 +12,229 @@
 #define GUI_FILE_DIALOG_IMPLEMENTATION
 #include "gui_file_dialog.h"
 
+#ifdef _WIN32
+// windows.h clashes with the names raylib uses, so only the one function needed is declared
+extern "C" __declspec(dllimport) int __stdcall MoveFileExA(const char* existing, const char* replacement, unsigned long flags);
+extern "C" __declspec(dllimport) int __stdcall CreateDirectoryA(const char* path, void* security);
+#else
+#include <sys/stat.h>
+#endif
+
 namespace sym {
 
 char Input::nextText = 'a';
 char InputBlock::nextText = 'A';
 Font font;
-
-struct CompIdx {
-    int compIdx;
-    Connector::Type type;
-    int connIdx;
+NetState Connector::nets;
+bool Connector::saveValues = true;
+
+// Files saved before the header existed start straight with the project data
+const char PROJECT_MAGIC[4] = { 'P', 'S', 'F', '1' };
+const char COMPRESSED_MAGIC[4] = { 'P', 'S', 'F', 'Z' };
+// 2: connector positions are no longer stored, they follow from the component's rect
+// 3: project data starts with the sequence number of the last journal record it contains
+// 4: library blocks are stored with their color and size in front, so they can be loaded lazily
+// 5: library blocks are references to block library files in the lib folder next to the project
+// 6: connectors store their width and value as a word, input and output blocks whether they are a bus
+// 7: gates store their delay
+// 8: RAM contents of block instances follow the board
+const int PROJECT_VERSION = 8;
+const char JOURNAL_MAGIC[4] = { 'P', 'S', 'F', 'J' };
+const char LIBRARY_MAGIC[4] = { 'P', 'S', 'F', 'L' };
+
+enum class LibraryEntry : unsigned char {
+    EMBEDDED,
+    REFERENCE
 };
+// Number of journal records after which the project is rewritten as a whole
+const int COMPACT_RECORDS = 1000;
+// Seconds between autosaves folding the journal into the project file
+const double AUTOSAVE_INTERVAL = 60;
+// Oldest undo steps are dropped past this many
+const int UNDO_LIMIT = 1000;
+// Pasted components are shifted by this much from the copied ones
+const float PASTE_OFFSET = 20;
+const int CHUNK_SIZE = 1 << 20;
+
+struct ProjectFile {
+    std::vector<char> data;
+    size_t offset = 0;
+    int version = 0;
+    bool compressed = false;
+};
+
+// Built once per save, so looking up a line endpoint doesn't scan every component
+ConnectorIndex IndexConnectors(std::vector<Component*>& comps) {
+    size_t size = 0;
+    for (auto& comp : comps)
+        size += comp->inConns.size() + comp->outConns.size();
 
-CompIdx GetComponentIdx(std::vector<Line*>& connections, std::vector<Component*>& comps, Connector* conn) {
+    ConnectorIndex index;
+    index.reserve(size);
     for (int i = 0; i < comps.size(); i++) {
-        for (int j = 0; j < comps[i]->outConns.size(); j++) {
-            if (&comps[i]->outConns[j] == conn)
-                return { i, Connector::Type::OUT, j };
-        }
-        for (int j = 0; j < comps[i]->inConns.size(); j++) {
-            if (&comps[i]->inConns[j] == conn)
-                return { i, Connector::Type::IN, j };
-        }
+        for (int j = 0; j < comps[i]->outConns.size(); j++)
+            index.emplace(&comps[i]->outConns[j], CompIdx{ i, Connector::Type::OUT, j });
+        for (int j = 0; j < comps[i]->inConns.size(); j++)
+            index.emplace(&comps[i]->inConns[j], CompIdx{ i, Connector::Type::IN, j });
     }
+    return index;
+}
+
+CompIdx GetComponentIdx(const ConnectorIndex& index, Connector* conn) {
+    auto it = index.find(conn);
+    if (it != index.end())
+        return it->second;
     return { -1, Connector::Type::IN, -1 };
 }
 
-void Write(std::ofstream &os, std::string *data) {
+void Write(std::ostream &os, std::string *data) {
     size_t size = data->size();
     os.write((const char *)&size, sizeof(size_t));
     os.write(data->c_str(), data->size());
 }
 
-void Write(std::ofstream &s, Connector *conn, std::vector<Line *> &connections,
-           std::vector<Component *> &comps) {
-    CompIdx idx = GetComponentIdx(connections, comps, conn);
+// For single lookups outside of saving, the connector's parent tells where to look
+CompIdx GetComponentIdx(std::vector<Component*>& comps, Connector* conn) {
+    auto it = std::find(comps.begin(), comps.end(), conn->parent);
+    if (it != comps.end()) {
+        Component* comp = *it;
+        int i = it - comps.begin();
+        if (!comp->outConns.empty() && conn >= &comp->outConns.front() && conn <= &comp->outConns.back())
+            return { i, Connector::Type::OUT, (int)(conn - &comp->outConns[0]) };
+        if (!comp->inConns.empty() && conn >= &comp->inConns.front() && conn <= &comp->inConns.back())
+            return { i, Connector::Type::IN, (int)(conn - &comp->inConns[0]) };
+    }
+    return { -1, Connector::Type::IN, -1 };
+}
+
+// Serializes fields one after another, used to build journal records
+template <typename... T>
+std::string Pack(T... fields) {
+    std::ostringstream s(std::ios_base::binary);
+    int unused[] = { 0, (Write(s, &fields), 0)... };
+    (void)unused;
+    return s.str();
+}
+
+// Count followed by the indices, for records naming many components
+std::string PackIndices(std::vector<int> indices) {
+    std::ostringstream s(std::ios_base::binary);
+    size_t size = indices.size();
+    Write(s, &size);
+    for (auto& idx : indices)
+        Write(s, &idx);
+    return s.str();
+}
+
+// Records putting back every line that removing the given component or connector deletes, all lines without either
+void SaveLines(std::vector<Edit>& edits, Block& block, Component* comp, Connector* conn = nullptr) {
+    bool all = !comp && !conn;
+    for (auto& line : block.connections) {
+        Connector* start = line->start;
+        Connector* end = line->end;
+        if (all || (comp && (start->parent == comp || end->parent == comp)) || (conn && (start == conn || end == conn)))
+            edits.push_back({ JournalOp::ADD_CONNECTION,
+                              Pack(GetComponentIdx(block.comps, start), GetComponentIdx(block.comps, end)) });
+    }
+}
+
+// Records putting a deleted component back at its place
+Edit SaveComponent(std::vector<Component*>& comps, int idx) {
+    std::ostringstream data(std::ios_base::binary);
+    Write(data, &idx);
+    comps[idx]->Save(data);
+    return { JournalOp::INSERT_COMPONENT, data.str() };
+}
+
+void Write(std::ostream &s, Connector *conn, const ConnectorIndex &index) {
+    CompIdx idx = GetComponentIdx(index, conn);
     Write(s, &idx);
 }
 
-void Read(std::ifstream &is, std::string *data) {
+// Every element takes at least a byte, so a count larger than what is left is corrupt
+void ReadCount(Reader &s, size_t *size) {
+    Read(s, size);
+    if (*size > s.size - s.pos) {
+        s.fail = true;
+        *size = 0;
+    }
+}
+
+void Read(Reader &is, std::string *data) {
     size_t size;
-    is.read((char *)&size, sizeof(size_t));
-    char buffer[255] = {};
-    is.read(buffer, size);
-    data->append(buffer);
+    ReadCount(is, &size);
+    data->assign(is.data + is.pos, size);
+    is.pos += size;
 }
 
-Connector* Read(std::ifstream &s, std::vector<Line *> &connections, std::vector<Component *> &comps) {
+Connector* Read(Reader &s, std::vector<Line *> &connections, std::vector<Component *> &comps) {
     CompIdx idx;
     Read(s, &idx);
 
-    Connector* result = nullptr;
-    if (idx.type == Connector::Type::OUT) {
-        result = &comps[idx.compIdx]->outConns[idx.connIdx];
-    } else {
-        result = &comps[idx.compIdx]->inConns[idx.connIdx];
+    if (idx.compIdx < 0 || idx.compIdx >= comps.size() || idx.connIdx < 0) {
+        s.fail = true;
+        return nullptr;
+    }
+    auto& conns = idx.type == Connector::Type::OUT ? comps[idx.compIdx]->outConns : comps[idx.compIdx]->inConns;
+    if (idx.connIdx >= conns.size()) {
+        s.fail = true;
+        return nullptr;
+    }
+
+    return &conns[idx.connIdx];
+}
+
+Component* ReadComponent(Reader& s, Arena& arena) {
+    Component::Type type;
+    Read(s, &type);
+    switch (type) {
+    case Component::Type::INPUT1:
+        return arena.New<Input>(s, type);
+    case Component::Type::OUTPUT1:
+        return arena.New<Output>(s, type);
+    case Component::Type::OUTPUT2:
+    case Component::Type::OUTPUT4:
+    case Component::Type::OUTPUT8:
+        return arena.New<OutputBlock>(s, type);
+    case Component::Type::GATE:
+        return arena.New<Gate>(s, type);
+    case Component::Type::INPUT2:
+    case Component::Type::INPUT4:
+    case Component::Type::INPUT8:
+        return arena.New<InputBlock>(s, type);
+    case Component::Type::BLOCK:
+        return arena.New<Block>(s, type);
+    case Component::Type::SPLITTER:
+    case Component::Type::MERGER:
+        return arena.New<Splitter>(s, type);
+    case Component::Type::MACRO:
+        return arena.New<Macro>(s, type);
+    case Component::Type::RAM:
+    case Component::Type::ROM:
+        return arena.New<Memory>(s, type);
+    default:
+        s.fail = true;
+        break;
     }
-    return result;
+    return nullptr;
 }
 
-void ReadComponents(std::ifstream& s, std::vector<Component*>& comps) {
+void ReadComponents(Reader& s, std::vector<Component*>& comps, Arena& arena) {
     size_t size;
-    Read(s, &size);
+    ReadCount(s, &size);
     comps.reserve(size);
     for (int i = 0; i < size; i++) {
-        Component::Type type;
-        Read(s, &type);
-        switch (type) {
-        case Component::Type::INPUT1:
-            comps.push_back(new Input(s, type));
-            break;
-        case Component::Type::OUTPUT1:
-            comps.push_back(new Output(s, type));
-            break;
-        case Component::Type::OUTPUT2:
-        case Component::Type::OUTPUT4:
-        case Component::Type::OUTPUT8:
-            comps.push_back(new OutputBlock(s, type));
-            break;
-        case Component::Type::GATE:
-            comps.push_back(new Gate(s, type));
-            break;
-        case Component::Type::INPUT2:
-        case Component::Type::INPUT4:
-        case Component::Type::INPUT8:
-            comps.push_back(new InputBlock(s, type));
-            break;
-        case Component::Type::BLOCK:
-            comps.push_back(new Block(s, type));
-            break;
-        default:
-            break;
-        }
+        Component* comp = ReadComponent(s, arena);
+        if (comp)
+            comps.push_back(comp);
     }
 }
 
+// Rectangle spanned by the rubber band, whichever way it was dragged
+Rectangle SelectionRect(const Vector2& start, const Vector2& end) {
+    return { std::min(start.x, end.x), std::min(start.y, end.y), std::abs(end.x - start.x), std::abs(end.y - start.y) };
+}
+
 bool IsInputComponent(Component *comp) {
     return (comp->type == Component::Type::INPUT1 || comp->type == Component::Type::INPUT2 ||
             comp->type == Component::Type::INPUT4 || comp->type == Component::Type::INPUT8);
@@ -115,76 +245,111 @@ bool IsOutputComponent(Component *comp) {
             comp->type == Component::Type::OUTPUT4 || comp->type == Component::Type::OUTPUT8);
 }
 
-std::vector<Connector*> GetNextConnector(std::vector<Line*>& connections, Connector* conn) {
-    if (!conn) return {};
+Color LevelColor(int level, Color low = GRAY) {
+    switch (level) {
+    case NetState::HIGH:
+        return RED;
+    case NetState::HIGH_Z:
+        return SKYBLUE;
+    case NetState::X:
+        return ORANGE;
+    default:
+        return low;
+    }
+}
 
-    std::vector<Connector*> nextList;
-    for (auto& line : connections) {
-        if (conn->type == Connector::Type::IN) {
-            if (line->end == conn) {
-                nextList.push_back(line->start);
-                // Only one connection to input allowed
-                break;
-            }
-        } else {
-            if (line->start == conn)
-                nextList.push_back(line->end);
+// Red when any bit is set, for a bus X wins over Z and both over a value
+Color ValueColor(const Connector& conn, Color low = GRAY) {
+    uint64_t unknown = conn.UnknownWord();
+    if (unknown)
+        return LevelColor((conn.Word() & unknown) ? NetState::X : NetState::HIGH_Z);
+    return conn.Word() ? RED : low;
+}
+
+// Input and output blocks of more than one bit can carry them on a bus
+bool IsBusBlock(Component *comp) {
+    return (IsInputComponent(comp) || IsOutputComponent(comp)) &&
+           comp->type != Component::Type::INPUT1 && comp->type != Component::Type::OUTPUT1;
+}
+
+// Puts an input on the net of its only driver, or on a net of its own when it has more of them
+void Rewire(Block& block, Connector* in) {
+    Connector* driver = nullptr;
+    int drivers = 0;
+    for (auto& line : block.connections) {
+        if (line->end == in) {
+            driver = line->start;
+            drivers++;
+        }
+    }
+    if (drivers > 1) {
+        if (!in->resolved) {
+            in->net = Connector::nets.AddRange(in->width);
+            in->resolved = true;
         }
+        return;
+    }
+    if (in->resolved) {
+        Connector::nets.RemoveRange(in->net, in->width);
+        in->resolved = false;
+    }
+    in->net = driver ? driver->net : NetState::ZERO;
+}
+
+// For lines loaded all at once
+void RewireAll(Block& block) {
+    std::unordered_map<Connector*, int> drivers;
+    for (auto& line : block.connections) {
+        if (++drivers[line->end] == 2)
+            Rewire(block, line->end);
     }
-    return nextList;
 }
 
-void AddConnection(std::vector<Line *> &connections, Connector *conn1, Connector *conn2) {
+void AddConnection(Block &block, Connector *conn1, Connector *conn2) {
     if (conn1 == conn2) return;
     if (conn1->type == conn2->type) {
         return;
     }
+    // A bus only connects to a bus of the same width
+    if (conn1->width != conn2->width)
+        return;
     Connector* in = conn1->type == Connector::Type::IN ? conn1 : conn2;
-    // Check if out connection is already connected
-    for (auto& conn : connections) {
+    Connector* out = conn1->type == Connector::Type::OUT ? conn1 : conn2;
+    // An input can have several drivers, but only one line from each
+    bool driven = false;
+    for (auto& conn : block.connections) {
         if (in == conn->end) {
-            return;
-        }
-    }
-    if (conn1->type == Connector::Type::OUT)
-        connections.push_back(new Line(conn1, conn2));
-    else
-        connections.push_back(new Line(conn2, conn1));
-}
-
-void UpdateConnections(std::vector<Line *> &connections, Connector *conn) {
-    if (!conn) return;
-
-    bool value = conn->value;
-    std::vector<Connector*> nextList = GetNextConnector(connections, conn);
-    for (auto next : nextList) {
-        if (next && next->type == Connector::Type::IN) {
-            next->value = value;
-            if (next->parent) {
-                std::vector<Connector *> outConns;
-                next->parent->Calc(outConns);
-                for (auto& out : outConns) {
-                    UpdateConnections(connections, out);
-                }
-            }
-        }
-    }
-}
-
-void UpdateConnections(std::vector<Component*> comps, std::vector<Line *> &connections) {
-    for (auto& comp : comps) {
-        if (IsInputComponent(comp)) {
-            for (auto& out : comp->outConns)
-                UpdateConnections(connections, &out);
+            if (out == conn->start)
+                return;
+            driven = true;
         }
-
     }
+    block.connections.push_back(block.arena->New<Line>(out, in));
+    if (driven)
+        Rewire(block, in);
 }
 
-Connector::Connector(std::ifstream &s, Component *parent) : parent(parent) {
+Connector::Connector(Reader &s, Component *parent) : parent(parent), pos({0, 0}) {
     Read(s, &type);
-    Read(s, &pos);
-    Read(s, &value);
+    if (s.version < 2)
+        Read(s, &pos);
+    uint64_t value = 0;
+    if (s.version >= 6) {
+        Read(s, &width);
+        Read(s, &value);
+    } else {
+        bool bit;
+        Read(s, &bit);
+        value = bit;
+    }
+    if (width < 1 || width > 64) {
+        s.fail = true;
+        width = 1;
+    }
+    // Inputs get their value from the net they are wired to
+    net = NewNet(type, width);
+    if (type == Type::OUT)
+        SetWord(value);
 
     int isBypass;
     Read(s, &isBypass);
@@ -199,43 +364,52 @@ Connector::Connector(std::ifstream &s, Component *parent) : parent(parent) {
     }
 }
 
-void Connector::Save(std::ofstream &s) {
+void Connector::Save(std::ostream &s, const ConnectorIndex *index) {
     Write(s, &type);
-    Write(s, &pos);
+    Write(s, &width);
+    uint64_t value = saveValues ? Word() : 0;
     Write(s, &value);
     int isBypass = conn != nullptr;
     Write(s, &isBypass);
 
     if (isBypass) {
-        // Only blocks can have bypass connector
-        Block* block = static_cast<Block*>(parent);
-        CompIdx idx = GetComponentIdx(block->connections, block->comps, conn);
+        // Only blocks can have bypass connector, they pass their index
+        CompIdx idx = GetComponentIdx(*index, conn);
         Write(s, &idx);
     }
 }
 
-Component* Component::Clone(Component* comp) {
+Component* Component::Clone(Component* comp, Arena& arena) {
     switch (comp->type) {
     case Component::Type::INPUT1:
-        return new Input(static_cast<Input*>(comp));
+        return arena.New<Input>(static_cast<Input*>(comp));
     case Component::Type::INPUT2:
-        return new InputBlock(static_cast<InputBlock *>(comp));
+        return arena.New<InputBlock>(static_cast<InputBlock*>(comp));
     case Component::Type::INPUT4:
-        return new InputBlock(static_cast<InputBlock *>(comp));
+        return arena.New<InputBlock>(static_cast<InputBlock*>(comp));
     case Component::Type::INPUT8:
-        return new InputBlock(static_cast<InputBlock *>(comp));
+        return arena.New<InputBlock>(static_cast<InputBlock*>(comp));
     case Component::Type::OUTPUT1:
-        return new Output(static_cast<Output*>(comp));
+        return arena.New<Output>(static_cast<Output*>(comp));
     case Component::Type::OUTPUT2:
-        return new OutputBlock(static_cast<OutputBlock *>(comp));
+        return arena.New<OutputBlock>(static_cast<OutputBlock*>(comp));
     case Component::Type::OUTPUT4:
-        return new OutputBlock(static_cast<OutputBlock *>(comp));
+        return arena.New<OutputBlock>(static_cast<OutputBlock*>(comp));
     case Component::Type::OUTPUT8:
-        return new OutputBlock(static_cast<OutputBlock *>(comp));
+        return arena.New<OutputBlock>(static_cast<OutputBlock*>(comp));
     case Component::Type::GATE:
-        return new Gate(static_cast<Gate*>(comp));
+        return arena.New<Gate>(static_cast<Gate*>(comp));
     case Component::Type::BLOCK:
-        return new Block(static_cast<Block*>(comp));
+        static_cast<Block*>(comp)->Load();
+        return arena.New<Block>(static_cast<Block*>(comp));
+    case Component::Type::SPLITTER:
+    case Component::Type::MERGER:
+        return arena.New<Splitter>(static_cast<Splitter*>(comp));
+    case Component::Type::MACRO:
+        return arena.New<Macro>(static_cast<Macro*>(comp));
+    case Component::Type::RAM:
+    case Component::Type::ROM:
+        return arena.New<Memory>(static_cast<Memory*>(comp));
     default:
         break;
     }
@@ -290,61 +464,88 @@ Connector* Component::CheckEndpoints(const Vector2& pos) {
     return nullptr;
 }
 
-void Component::Save(std::ofstream &s) {
+void Component::Save(std::ostream &s) {
     Write(s, &type);
     Write(s, &rect);
     Write(s, &text);
 }
 
-Gate::Gate(std::ifstream& s, Component::Type type): Component(s, type) {
+Gate::Gate(Reader& s, Component::Type type): Component(s, type) {
     Read(s, &gateType);
+    // Buffers are only made by the engine
+    if (gateType < Type::NOT || gateType > Type::TRI || gateType == Type::BUF) {
+        s.fail = true;
+        gateType = Type::AND;
+    }
 
     size_t size;
-    Read(s, &size);
+    ReadCount(s, &size);
+    if (size == 0 || size > MAX_INPUTS) {
+        s.fail = true;
+        size = 0;
+    }
     for (int i = 0; i < size; i++)
         inConns.emplace_back(s, this);
 
     outConns.emplace_back(s, this);
-}
-
-void Gate::Calc(std::vector<Connector*>& _outConns) {
-    switch (gateType) {
-    case Type::NOT:
-        outConns[0].value = !inConns[0].value;
-        break;
-    case Type::AND:
-        outConns[0].value = inConns[0].value & inConns[1].value;
-        break;
+    if (s.version >= 7)
+        Read(s, &delay);
+    if (delay < 1 || delay > MAX_DELAY) {
+        s.fail = true;
+        delay = 1;
     }
-    return _outConns.push_back(&outConns[0]);
+    PlaceConnectors();
 }
 
 void Gate::Draw() {
     float x = rect.x;
     float y = rect.y;
+    float middle = y + rect.height / 2;
 
-    DrawCircle(x + 45, y + 15, 15, BLUE);
-    DrawRectangle(x + 15, y, 30, HEIGHT, BLUE);
+    DrawCircle(x + 45, middle, 15, BLUE);
+    DrawRectangle(x + 15, y, 30, rect.height, BLUE);
 
-    Vector2 pos = GetMousePosition();
-    if (inConns.size() == 1) {
-        DrawLineEx({x + 5, y + 15}, {x + 15, y + 15}, 3.0, BLUE);
-        DrawCircle(x + 5, y + 15, 5, inConns[0].value ? RED : GRAY);
-    } else {
-        DrawLineEx({x + 5, y + 5}, {x + 15, y + 5}, 3.0, BLUE);
-        DrawLineEx({x + 5, y + 25}, {x + 15, y + 25}, 3.0, BLUE);
-        DrawCircle(x + 5, y + 5, 5, inConns[0].value ? RED : GRAY);
-        DrawCircle(x + 5, y + 25, 5, inConns[1].value ? RED : GRAY);
+    for (auto& in : inConns) {
+        DrawLineEx({x + 5, in.pos.y}, {x + 15, in.pos.y}, 3.0, BLUE);
+        DrawCircle(x + 5, in.pos.y, 5, ValueColor(in));
     }
 
-    DrawLineEx({x + 60, y + 15}, {x + 70, y + 15}, 3.0, BLUE);
-    DrawCircle(x + 70, y + 15, 5, outConns[0].value ? RED : GRAY);
-    DrawTextEx(font, text.c_str(), { x + 23, y + 7 }, 15, 1, RAYWHITE);
+    DrawLineEx({x + 60, middle}, {x + 70, middle}, 3.0, BLUE);
+    DrawCircle(x + 70, middle, 5, ValueColor(outConns[0]));
+    DrawTextEx(font, text.c_str(), { x + 18, middle - 8 }, 15, 1, RAYWHITE);
+    if (delay != 1)
+        DrawTextEx(font, TextFormat("%d", delay), { x + 38, middle + 4 }, 11, 1, RAYWHITE);
 
     Component::Draw();
 }
 
-void Gate::Save(std::ofstream& s) {
+// Two inputs keep the original spacing, wider gates pack them closer and grow to fit
+void Gate::PlaceConnectors() {
+    float x = rect.x;
+    float y = rect.y;
+    float pitch = inConns.size() <= 2 ? 20 : 12;
+    rect.height = std::max<float>(HEIGHT, 10 + pitch * (inConns.size() - 1));
+    if (inConns.size() == 1) {
+        inConns[0].pos = {x + 5, y + 15};
+    } else {
+        for (int i = 0; i < inConns.size(); i++)
+            inConns[i].pos = {x + 5, y + 5 + pitch * i};
+    }
+    for (auto& out : outConns)
+        out.pos = {x + 70, y + rect.height / 2};
+}
+
+// Lines on removed inputs have to be deleted by the caller first
+void Gate::SetInputs(int count) {
+    count = std::max(2, std::min(count, MAX_INPUTS));
+    while (inConns.size() > count)
+        inConns.pop_back();
+    while (inConns.size() < count)
+        inConns.push_back(Connector(this, {rect.x + 5, rect.y}, Connector::Type::IN));
+    PlaceConnectors();
+}
+
+void Gate::Save(std::ostream& s) {
     Component::Save(s);
     Write(s, &gateType);
 
@@ -354,14 +555,16 @@ void Gate::Save(std::ofstream& s) {
         inConn.Save(s);
 
     outConns[0].Save(s);
+    Write(s, &delay);
 }
 
-Input::Input(std::ifstream& s, Component::Type type): Component(s, type) {
+Input::Input(Reader& s, Component::Type type): Component(s, type) {
     outConns.emplace_back(s, this);
+    PlaceConnectors();
 }
 
 void Input::Draw() {
-    Color color = outConns[0].value ? RED : GRAY;
+    Color color = outConns[0].Value() ? RED : GRAY;
 
     DrawRectangle(rect.x, rect.y, 20, HEIGHT, color);
     DrawTriangle({rect.x + 20, rect.y}, {rect.x + 20, rect.y + HEIGHT}, {rect.x + 30, rect.y + HEIGHT / 2}, color);
@@ -371,19 +574,75 @@ void Input::Draw() {
     Component::Draw();
 }
 
-void Input::Save(std::ofstream& s) {
+void Input::PlaceConnectors() {
+    outConns[0].pos = {rect.x + 35, rect.y + 15};
+}
+
+void Input::Save(std::ostream& s) {
     Component::Save(s);
     outConns[0].Save(s);
 }
 
-InputBlock::InputBlock(std::ifstream& s, Component::Type type) : Component(s, type) {
+InputBlock::InputBlock(Reader& s, Component::Type type) : Component(s, type) {
     size_t size;
-    Read(s, &size);
+    ReadCount(s, &size);
     for (int i = 0; i < size; i++)
         outConns.emplace_back(s, this);
 
     Read(s, &isIcon);
     Read(s, &isSigned);
+    if (s.version >= 6)
+        Read(s, &bus);
+    if (outConns.empty() || (bus && outConns.size() != 1)) {
+        s.fail = true;
+        bus = false;
+        if (outConns.empty())
+            outConns.push_back(Connector(this, {}, Connector::Type::OUT));
+    }
+    PlaceConnectors();
+}
+
+void InputBlock::SetBit(int i, bool value) {
+    if (!bus) {
+        outConns[i].SetValue(value);
+        return;
+    }
+    uint64_t mask = uint64_t(1) << (Bits() - 1 - i);
+    uint64_t word = outConns[0].Word();
+    outConns[0].SetWord(value ? word | mask : word & ~mask);
+}
+
+int InputBlock::BitAt(const Vector2& pos) const {
+    for (int i = 0; i < Bits(); i++) {
+        if (CheckCollisionPointCircle(pos, BitPos(i), 5))
+            return i;
+    }
+    return -1;
+}
+
+// Lines on the connectors have to be deleted by the caller first, the value is kept
+void InputBlock::SetBus(bool bus) {
+    if (bus == this->bus)
+        return;
+    int bits = Bits();
+    uint64_t word = 0;
+    for (int i = 0; i < bits; i++)
+        word = word << 1 | Bit(i);
+    for (auto& out : outConns)
+        Connector::nets.RemoveRange(out.net, out.width);
+    outConns.clear();
+    this->bus = bus;
+    if (bus) {
+        outConns.push_back(Connector(this, {}, Connector::Type::OUT, bits));
+        outConns[0].SetWord(word);
+    } else {
+        for (int i = 0; i < bits; i++) {
+            outConns.push_back(Connector(this, {}, Connector::Type::OUT));
+            outConns[i].SetValue(word >> (bits - 1 - i) & 1);
+        }
+    }
+    rect.width = WIDTH + (bus ? 10 : 0);
+    PlaceConnectors();
 }
 
 void InputBlock::Draw() {
@@ -400,22 +659,28 @@ void InputBlock::Draw() {
 
         Vector2 pos = GetMousePosition();
 
-        for (int i = outConns.size() - 1; i >= 0; i--) {
-            Color connColor = outConns[i].value ? RED : GRAY;
-            DrawCircle(outConns[i].pos.x, outConns[i].pos.y, 5, connColor);
+        for (int i = Bits() - 1; i >= 0; i--) {
+            Vector2 bitPos = BitPos(i);
+            Color connColor = Bit(i) ? RED : GRAY;
+            DrawCircle(bitPos.x, bitPos.y, 5, connColor);
 
-            value += outConns[i].value * mod;
+            value += Bit(i) * mod;
             mod *= 2;
         }
-        if (isSigned && outConns[0].value) {
-            value -= pow(2, outConns.size() - 1);
+        if (bus) {
+            Vector2 busPos = outConns[0].pos;
+            DrawLineEx({rect.x + WIDTH, busPos.y}, busPos, 5.0, DARKGRAY);
+            DrawCircle(busPos.x, busPos.y, 6, outConns[0].Word() ? RED : DARKGRAY);
+        }
+        if (isSigned && Bit(0)) {
+            value -= pow(2, Bits() - 1);
             value *= -1;
         }
         float saturation = value; // 0.5 (1) - 1.0 (255)
         Color color = value ? ColorFromHSV(360, 0.5 + abs((float)value) / 512, 1) : GRAY;
-        DrawRectangleRounded({rect.x, rect.y, rect.width - 10, rect.height}, 0.3, 5, color);
+        DrawRectangleRounded({rect.x, rect.y, WIDTH - 10, rect.height}, 0.3, 5, color);
         if (isSigned) {
-            char sign = !outConns[0].value ? '+' : ' ';
+            char sign = !Bit(0) ? '+' : ' ';
             DrawTextEx(font, TextFormat("%c%d", sign, value), { rect.x, rect.y + 5 }, 16, 1, RAYWHITE);
         } 
         else
@@ -425,7 +690,16 @@ void InputBlock::Draw() {
     Component::Draw();
 }
 
-void InputBlock::Save(std::ofstream& s) {
+void InputBlock::PlaceConnectors() {
+    if (bus) {
+        outConns[0].pos = {rect.x + WIDTH + 5, rect.y + rect.height / 2};
+        return;
+    }
+    for (int i = 0; i < outConns.size(); i++)
+        outConns[i].pos = BitPos(i);
+}
+
+void InputBlock::Save(std::ostream& s) {
     Component::Save(s);
 
     size_t size = outConns.size();
@@ -435,17 +709,19 @@ void InputBlock::Save(std::ofstream& s) {
 
     Write(s, &isIcon);
     Write(s, &isSigned);
+    Write(s, &bus);
 }
 
-Output::Output(std::ifstream& s, Component::Type type) : Component(s, type) {
+Output::Output(Reader& s, Component::Type type) : Component(s, type) {
     size_t size;
-    Read(s, &size);
+    ReadCount(s, &size);
     for (int i = 0; i < size; i++)
         inConns.emplace_back(s, this);
+    PlaceConnectors();
 }
 
 void Output::Draw() {
-    Color color = inConns[0].value ? RED : GRAY;
+    Color color = ValueColor(inConns[0]);
 
     DrawRectangle(rect.x + 20, rect.y, 20, HEIGHT, color);
     DrawTriangle({rect.x + 20, rect.y}, {rect.x + 10, rect.y + HEIGHT / 2 }, {rect.x + 20, rect.y + HEIGHT}, color);
@@ -455,7 +731,12 @@ void Output::Draw() {
     Component::Draw();
 }
 
-void Output::Save(std::ofstream& s) {
+void Output::PlaceConnectors() {
+    for (auto& in : inConns)
+        in.pos = {rect.x + 5, rect.y + 15};
+}
+
+void Output::Save(std::ostream& s) {
     Component::Save(s);
 
     size_t size = inConns.size();
@@ -464,14 +745,40 @@ void Output::Save(std::ofstream& s) {
         inConn.Save(s);
 }
 
-OutputBlock::OutputBlock(std::ifstream& s, Component::Type type) : Component(s, type) {
+OutputBlock::OutputBlock(Reader& s, Component::Type type) : Component(s, type) {
     size_t size;
-    Read(s, &size);
+    ReadCount(s, &size);
     for (int i = 0; i < size; i++)
         inConns.emplace_back(s, this);
 
     Read(s, &isIcon);
     Read(s, &isSigned);
+    if (s.version >= 6)
+        Read(s, &bus);
+    if (inConns.empty() || (bus && inConns.size() != 1)) {
+        s.fail = true;
+        bus = false;
+        if (inConns.empty())
+            inConns.push_back(Connector(this, {}, Connector::Type::IN));
+    }
+    PlaceConnectors();
+}
+
+// Lines on the connectors have to be deleted by the caller first
+void OutputBlock::SetBus(bool bus) {
+    if (bus == this->bus)
+        return;
+    int bits = Bits();
+    inConns.clear();
+    this->bus = bus;
+    if (bus) {
+        inConns.push_back(Connector(this, {}, Connector::Type::IN, bits));
+    } else {
+        for (int i = 0; i < bits; i++)
+            inConns.push_back(Connector(this, {}, Connector::Type::IN));
+    }
+    rect.width = WIDTH + (bus ? 10 : 0);
+    PlaceConnectors();
 }
 
 void OutputBlock::Draw() {
@@ -487,32 +794,49 @@ void OutputBlock::Draw() {
         int mod = 1;
 
         Vector2 pos = GetMousePosition();
-        for (int i = inConns.size() - 1; i >= 0; i--) {
-            Color connColor = inConns[i].value ? RED : GRAY;
-            DrawCircle(inConns[i].pos.x, inConns[i].pos.y, 5, connColor);
+        for (int i = Bits() - 1; i >= 0; i--) {
+            Vector2 bitPos = BitPos(i);
+            Color connColor = LevelColor(BitLevel(i));
+            DrawCircle(bitPos.x, bitPos.y, 5, connColor);
 
-            value += inConns[i].value * mod;
+            value += Bit(i) * mod;
             mod *= 2;
         }
-        if (isSigned && inConns[0].value) {
-            value -= pow(2, inConns.size() - 1);
+        // The body is shifted right to make room for the bus connector
+        float x = rect.x + (bus ? 10 : 0);
+        if (bus) {
+            Vector2 busPos = inConns[0].pos;
+            DrawLineEx(busPos, {x + 10, busPos.y}, 5.0, DARKGRAY);
+            DrawCircle(busPos.x, busPos.y, 6, ValueColor(inConns[0], DARKGRAY));
+        }
+        if (isSigned && Bit(0)) {
+            value -= pow(2, Bits() - 1);
             value *= -1;
         }
         float saturation = value; // 0.5 (1) - 1.0 (255)
         Color color = value ? ColorFromHSV(360, 0.5 + abs((float)value) / 512, 1) : GRAY;
-        DrawRectangleRounded({rect.x + 10, rect.y, rect.width - 10, rect.height}, 0.3, 5, color);
+        DrawRectangleRounded({x + 10, rect.y, WIDTH - 10, rect.height}, 0.3, 5, color);
         if (isSigned) {
-            char sign = !inConns[0].value ? '+' : ' ';
-            DrawTextEx(font, TextFormat("%c%d", sign, value), { rect.x + 13, rect.y + 5 }, 16, 1, RAYWHITE);
+            char sign = !Bit(0) ? '+' : ' ';
+            DrawTextEx(font, TextFormat("%c%d", sign, value), { x + 13, rect.y + 5 }, 16, 1, RAYWHITE);
         }
         else
-            DrawTextEx(font, TextFormat("%d", value), { rect.x + 15, rect.y + 5 }, 16, 1, RAYWHITE);
+            DrawTextEx(font, TextFormat("%d", value), { x + 15, rect.y + 5 }, 16, 1, RAYWHITE);
     }
 
     Component::Draw();
 }
 
-void OutputBlock::Save(std::ofstream& s) {
+void OutputBlock::PlaceConnectors() {
+    if (bus) {
+        inConns[0].pos = {rect.x + 5, rect.y + rect.height / 2};
+        return;
+    }
+    for (int i = 0; i < inConns.size(); i++)
+        inConns[i].pos = BitPos(i);
+}
+
+void OutputBlock::Save(std::ostream& s) {
     Component::Save(s);
 
     size_t size = inConns.size();
@@ -522,213 +846,1771 @@ void OutputBlock::Save(std::ofstream& s) {
 
     Write(s, &isIcon);
     Write(s, &isSigned);
+    Write(s, &bus);
 }
 
-Block::Block(float x, float y, const char *text, Color color, std::vector<Component *> comps,
-      std::vector<Line *> connections)
-    : Component(x, y, WIDTH, HEIGHT, text, Component::Type::BLOCK), color(color), refCounter(0) {
+Splitter::Splitter(Reader& s, Component::Type type) : Component(s, type) {
+    size_t size;
+    ReadCount(s, &size);
+    for (int i = 0; i < size; i++)
+        inConns.emplace_back(s, this);
+    ReadCount(s, &size);
+    for (int i = 0; i < size; i++)
+        outConns.emplace_back(s, this);
 
-    for (auto& comp : comps) {
-        this->comps.push_back(comp);
-    }
-    for (auto& line : connections) {
-        this->connections.push_back(line);
+    int width = Width();
+    bool valid = width >= 2 && width <= 64 && (Merger() ? outConns.size() : inConns.size()) == 1 &&
+        Bus().width == width;
+    for (auto& bit : Bits())
+        valid = valid && bit.width == 1;
+    if (!valid) {
+        s.fail = true;
+        inConns.clear();
+        for (auto& out : outConns)
+            Connector::nets.RemoveRange(out.net, out.width);
+        outConns.clear();
+        SetWidth(2);
     }
+    PlaceConnectors();
 }
 
-Block::Block(const Block *block)
-    : Component(block), color(block->color), isIcon(false) {
-    numInputs = 0;
-    numOutputs = 0;
-    refCounter += 1;
-
-    for (auto &comp : block->comps) {
-        switch (comp->type) {
-        case Type::INPUT1:
-            numInputs += 1;
-            break;
-        case Type::INPUT2:
-            numInputs += 2;
-            break;
-        case Type::INPUT4:
-            numInputs += 4;
-            break;
-        case Type::INPUT8:
-            numInputs += 8;
-            break;
-        case Type::OUTPUT1:
-            numOutputs += 1;
-            break;
-        case Type::OUTPUT2:
-            numOutputs += 1;
-            break;
-        case Type::OUTPUT4:
-            numOutputs += 1;
-            break;
-        case Type::OUTPUT8:
-            numOutputs += 1;
-            break;
-        }
-        comps.push_back(comp);
-    }
-    for (auto &line : block->connections) {
-        connections.push_back(line);
+void Splitter::SetWidth(int width) {
+    width = std::max(2, std::min(width, 64));
+    bool merger = Merger();
+    auto& bits = merger ? inConns : outConns;
+    auto& bus = merger ? outConns : inConns;
+    // Outputs give their nets back as they go
+    for (auto& conn : bus)
+        Connector::nets.RemoveRange(conn.type == Connector::Type::OUT ? conn.net : NetState::ZERO, conn.width);
+    bus.clear();
+    bus.push_back(Connector(this, {}, merger ? Connector::Type::OUT : Connector::Type::IN, width));
+    while (bits.size() > width) {
+        if (!merger)
+            Connector::nets.Remove(bits.back().net);
+        bits.pop_back();
     }
+    while (bits.size() < width)
+        bits.push_back(Connector(this, {}, merger ? Connector::Type::IN : Connector::Type::OUT));
+    PlaceConnectors();
+}
 
-    rect.width += 20;
+void Splitter::Draw() {
+    float x = rect.x;
+    float y = rect.y;
+    bool merger = Merger();
+    float barX = x + 12;
 
-    int inIdx = 0;
-    int outIdx = 0;
-    for (auto& comp : comps) {
-        if (IsInputComponent(comp)) {
-            for (auto& out : comp->outConns) {
-                inConns.push_back({this, {rect.x + 5, 10 + rect.y + 15 * inIdx++}, Connector::Type::IN, &out});
-            }
-        } else if (IsOutputComponent(comp)) {
-            for (auto& in : comp->inConns) {
-                outConns.push_back({this, {rect.x + rect.width - 5, 10 + rect.y + 15 * outIdx++}, Connector::Type::OUT, &in});
-            }
-        }
+    DrawRectangle(barX, y, 6, rect.height, DARKGRAY);
+    for (auto& bit : Bits()) {
+        DrawLineEx(bit.pos, {barX + (merger ? 0 : 6), bit.pos.y}, 2.0, DARKGRAY);
+        DrawCircle(bit.pos.x, bit.pos.y, 4, ValueColor(bit));
     }
+    Connector& busConn = Bus();
+    DrawLineEx(busConn.pos, {barX + (merger ? 6 : 0), busConn.pos.y}, 5.0, DARKGRAY);
+    DrawCircle(busConn.pos.x, busConn.pos.y, 6, ValueColor(busConn, DARKGRAY));
 
-    rect.height = std::max<float>(HEIGHT, std::max(inConns.size(), outConns.size()) * 15.0 + 10);
+    Component::Draw();
 }
 
-Block::Block(std::ifstream& s, Component::Type type) : Component(s, type), refCounter(0) {
-    ReadComponents(s, comps);
-
-    size_t size;
-    Read(s, &size);
-    for (int i = 0; i < size; i++) {
-        Connector* start = Read(s, connections, comps);
-        Connector* end = Read(s, connections, comps);
-        connections.push_back(new Line(start, end));
-    }
+void Splitter::PlaceConnectors() {
+    float x = rect.x;
+    float y = rect.y;
+    bool merger = Merger();
+    auto& bits = Bits();
+    rect.height = std::max<float>(HEIGHT, 10 + 12 * (bits.size() - 1));
+    for (int i = 0; i < bits.size(); i++)
+        bits[i].pos = {x + (merger ? 5 : 25), y + 5 + 12 * i};
+    Bus().pos = {x + (merger ? 25 : 5), y + rect.height / 2};
+}
 
-    Read(s, &size);
-    for (int i = 0; i < size; i++)
-        inConns.push_back(Connector(s, this));
+void Splitter::Save(std::ostream& s) {
+    Component::Save(s);
 
-    Read(s, &size);
-    for (int i = 0; i < size; i++)
-        outConns.push_back(Connector(s, this));
+    size_t size = inConns.size();
+    Write(s, &size);
+    for (auto& inConn : inConns)
+        inConn.Save(s);
 
-    Read(s, &color);
-    Read(s, &isIcon);
+    size = outConns.size();
+    Write(s, &size);
+    for (auto& outConn : outConns)
+        outConn.Save(s);
 }
 
-void Block::Calc(std::vector<Connector*>& _outConns) {
-    for (auto& in : inConns) {
-        if (in.conn)
-            in.conn->value = in.value;
+// Gives the component ports of the given widths. Ports keeping their width keep their connector,
+// so lines on them stay.
+void ResizePorts(Component* comp, const std::vector<int>& ins, const std::vector<int>& outs) {
+    auto& inConns = comp->inConns;
+    auto& outConns = comp->outConns;
+    for (int i = 0; i < outConns.size(); i++) {
+        if (i >= outs.size() || outConns[i].width != outs[i])
+            Connector::nets.RemoveRange(outConns[i].net, outConns[i].width);
     }
-    UpdateConnections(comps, connections);
-    Connector* result = nullptr;
-    for (auto& out : outConns) {
-        if (out.conn) {
-            out.value = out.conn->value;
-            result = &out;
-        }
-        _outConns.push_back(&out);
+    inConns.resize(std::min(inConns.size(), ins.size()));
+    outConns.resize(std::min(outConns.size(), outs.size()));
+    for (int i = 0; i < ins.size(); i++) {
+        if (i >= inConns.size())
+            inConns.push_back(Connector(comp, {}, Connector::Type::IN, ins[i]));
+        else if (inConns[i].width != ins[i])
+            inConns[i] = Connector(comp, {}, Connector::Type::IN, ins[i]);
+    }
+    for (int i = 0; i < outs.size(); i++) {
+        if (i >= outConns.size())
+            outConns.push_back(Connector(comp, {}, Connector::Type::OUT, outs[i]));
+        else if (outConns[i].width != outs[i])
+            outConns[i] = Connector(comp, {}, Connector::Type::OUT, outs[i]);
     }
 }
 
-void Block::Move(const Vector2 &delta) {
-    rect.x += delta.x;
-    rect.y += delta.y;
-    for (auto& in : inConns) {
-        in.pos.x += delta.x;
-        in.pos.y += delta.y;
+// Whether the connectors have the given widths
+bool HasPorts(Component* comp, const std::vector<int>& ins, const std::vector<int>& outs) {
+    if (comp->inConns.size() != ins.size() || comp->outConns.size() != outs.size())
+        return false;
+    for (int i = 0; i < ins.size(); i++) {
+        if (comp->inConns[i].width != ins[i])
+            return false;
     }
-    for (auto &out : outConns) {
-        out.pos.x += delta.x;
-        out.pos.y += delta.y;
+    for (int i = 0; i < outs.size(); i++) {
+        if (comp->outConns[i].width != outs[i])
+            return false;
     }
+    return true;
 }
 
-void Block::Draw() {
-    if (isIcon) {
-        DrawRectangleRounded({rect.x, rect.y, rect.width, rect.height}, 0.3, 5, color);
-        DrawTextEx(font, TextFormat("%.4s", text.c_str()), { rect.x + 3, rect.y + 5 }, 18, 1, RAYWHITE);
-    } else {
-        DrawRectangleRounded({rect.x + 10, rect.y, rect.width - 2 * 10, rect.height}, 0.3, 5, color);
+Macro::Macro(Reader& s, Component::Type type) : Component(s, type) {
+    Read(s, &kind);
+    Read(s, &width);
+
+    size_t size;
+    ReadCount(s, &size);
+    for (int i = 0; i < size; i++)
+        inConns.emplace_back(s, this);
+    ReadCount(s, &size);
+    for (int i = 0; i < size; i++)
+        outConns.emplace_back(s, this);
+
+    if (kind < Kind::ADD || kind > Kind::REG) {
+        s.fail = true;
+        kind = Kind::ADD;
+    }
+    bool valid = width >= 1 && width <= MaxWidth(kind);
+    if (valid) {
+        std::vector<int> ins, outs;
+        PortWidths(kind, width, ins, outs);
+        valid = HasPorts(this, ins, outs);
+    }
+    if (!valid) {
+        s.fail = true;
+        int fixed = std::max(1, std::min(width, MaxWidth(kind)));
+        width = 0;
+        SetWidth(fixed);
+    }
+    PlaceConnectors();
+}
+
+void Macro::PortWidths(Kind kind, int width, std::vector<int>& ins, std::vector<int>& outs) {
+    switch (kind) {
+    case Kind::ADD:
+    case Kind::SUB:
+        ins = { width, width, 1 };
+        outs = { width, 1 };
+        break;
+    case Kind::CMP:
+        ins = { width, width };
+        outs = { 1, 1, 1 };
+        break;
+    case Kind::MUX:
+        ins = { width, width, 1 };
+        outs = { width };
+        break;
+    case Kind::DEC:
+        ins = { width };
+        outs = { 1 << width };
+        break;
+    case Kind::SHF:
+        ins = { width, width, 1 };
+        outs = { width };
+        break;
+    case Kind::REG:
+        ins = { width, 1 };
+        outs = { width };
+        break;
+    case Kind::RAM:
+    case Kind::ROM:
+    case Kind::RESOLVE:
+        // Made by the engine with the ports of what they stand for, never placed as components
+        ins.clear();
+        outs.clear();
+        break;
+    }
+}
+
+void Macro::SetWidth(int width) {
+    width = std::max(1, std::min(width, MaxWidth(kind)));
+    std::vector<int> ins, outs;
+    PortWidths(kind, width, ins, outs);
+    ResizePorts(this, ins, outs);
+    this->width = width;
+    PlaceConnectors();
+}
+
+void Macro::Draw() {
+    float x = rect.x;
+    float y = rect.y;
+
+    DrawRectangleRounded({x + 10, y, WIDTH - 20, rect.height}, 0.3, 5, DARKBLUE);
+    for (auto& in : inConns) {
+        DrawLineEx(in.pos, {x + 10, in.pos.y}, in.width > 1 ? 5.0 : 3.0, DARKBLUE);
+        DrawCircle(in.pos.x, in.pos.y, in.width > 1 ? 6 : 5, ValueColor(in));
+    }
+    for (auto& out : outConns) {
+        DrawLineEx({x + WIDTH - 10, out.pos.y}, out.pos, out.width > 1 ? 5.0 : 3.0, DARKBLUE);
+        DrawCircle(out.pos.x, out.pos.y, out.width > 1 ? 6 : 5, ValueColor(out));
+    }
+    DrawTextEx(font, text.c_str(), { x + 13, y + 3 }, 13, 1, RAYWHITE);
+    DrawTextEx(font, TextFormat("%d", width), { x + 13, y + 16 }, 11, 1, RAYWHITE);
+
+    Component::Draw();
+}
+
+void Macro::PlaceConnectors() {
+    float x = rect.x;
+    float y = rect.y;
+    size_t ports = std::max(inConns.size(), outConns.size());
+    rect.height = std::max<float>(HEIGHT, 10 + 12 * (ports - 1));
+    for (int i = 0; i < inConns.size(); i++)
+        inConns[i].pos = {x + 5, y + 5 + 12 * i};
+    for (int i = 0; i < outConns.size(); i++)
+        outConns[i].pos = {x + WIDTH - 5, y + 5 + 12 * i};
+}
+
+void Macro::Save(std::ostream& s) {
+    Component::Save(s);
+    Write(s, &kind);
+    Write(s, &width);
+
+    size_t size = inConns.size();
+    Write(s, &size);
+    for (auto& inConn : inConns)
+        inConn.Save(s);
+
+    size = outConns.size();
+    Write(s, &size);
+    for (auto& outConn : outConns)
+        outConn.Save(s);
+}
+
+Memory::Memory(Reader& s, Component::Type type) : Component(s, type) {
+    Read(s, &addrWidth);
+    Read(s, &dataWidth);
+    Read(s, &contents);
+
+    size_t size;
+    ReadCount(s, &size);
+    for (int i = 0; i < size; i++)
+        inConns.emplace_back(s, this);
+    ReadCount(s, &size);
+    for (int i = 0; i < size; i++)
+        outConns.emplace_back(s, this);
+
+    bool valid = addrWidth >= 1 && addrWidth <= MAX_ADDRESS && dataWidth >= 1 && dataWidth <= 64;
+    if (valid) {
+        std::vector<int> ins, outs;
+        PortWidths(type, addrWidth, dataWidth, ins, outs);
+        valid = HasPorts(this, ins, outs) && contents.size() <= MaxBytes();
+    }
+    if (!valid) {
+        s.fail = true;
+        int fixedAddr = std::max(1, std::min(addrWidth, MAX_ADDRESS));
+        int fixedData = std::max(1, std::min(dataWidth, 64));
+        addrWidth = 0;
+        SetWidths(fixedAddr, fixedData);
+    }
+    PlaceConnectors();
+}
+
+void Memory::PortWidths(Component::Type type, int addrWidth, int dataWidth, std::vector<int>& ins, std::vector<int>& outs) {
+    if (type == Component::Type::ROM)
+        ins = { addrWidth };
+    else
+        ins = { addrWidth, dataWidth, 1, 1 };
+    outs = { dataWidth };
+}
+
+uint64_t Memory::Load(const std::string& contents, uint64_t addr, int wordBytes) {
+    size_t offset = addr * wordBytes;
+    if (offset >= contents.size())
+        return 0;
+    uint64_t value = 0;
+    size_t end = std::min(offset + wordBytes, contents.size());
+    for (size_t i = end; i > offset; i--)
+        value = value << 8 | (unsigned char)contents[i - 1];
+    return value;
+}
+
+void Memory::Store(std::string& contents, uint64_t addr, int wordBytes, uint64_t value) {
+    size_t offset = addr * wordBytes;
+    if (offset + wordBytes > contents.size()) {
+        // Words that were never written stay 0 without taking space
+        if (value == 0)
+            return;
+        contents.resize(offset + wordBytes, '\0');
+    }
+    for (int i = 0; i < wordBytes; i++)
+        contents[offset + i] = (char)(value >> (8 * i));
+}
+
+void Memory::SetWidths(int addrWidth, int dataWidth) {
+    this->addrWidth = std::max(1, std::min(addrWidth, MAX_ADDRESS));
+    this->dataWidth = std::max(1, std::min(dataWidth, 64));
+    std::vector<int> ins, outs;
+    PortWidths(type, this->addrWidth, this->dataWidth, ins, outs);
+    ResizePorts(this, ins, outs);
+    if (contents.size() > MaxBytes())
+        contents.resize(MaxBytes());
+    PlaceConnectors();
+}
+
+bool Memory::LoadImage(const char* path) {
+    std::ifstream file(path, std::ios::binary);
+    if (!file)
+        return false;
+    std::string data(MaxBytes(), '\0');
+    file.read(&data[0], data.size());
+    data.resize(file.gcount());
+    contents = std::move(data);
+    return true;
+}
+
+void Memory::Draw() {
+    float x = rect.x;
+    float y = rect.y;
+
+    DrawRectangleRounded({x + 10, y, WIDTH - 20, rect.height}, 0.3, 5, Rom() ? DARKPURPLE : DARKGREEN);
+    for (auto& in : inConns) {
+        DrawLineEx(in.pos, {x + 10, in.pos.y}, in.width > 1 ? 5.0 : 3.0, Rom() ? DARKPURPLE : DARKGREEN);
+        DrawCircle(in.pos.x, in.pos.y, in.width > 1 ? 6 : 5, ValueColor(in));
+    }
+    Connector& out = outConns[0];
+    DrawLineEx({x + WIDTH - 10, out.pos.y}, out.pos, out.width > 1 ? 5.0 : 3.0, Rom() ? DARKPURPLE : DARKGREEN);
+    DrawCircle(out.pos.x, out.pos.y, out.width > 1 ? 6 : 5, ValueColor(out));
+    DrawTextEx(font, text.c_str(), { x + 13, y + 3 }, 13, 1, RAYWHITE);
+    DrawTextEx(font, TextFormat("%dx%d", addrWidth, dataWidth), { x + 13, y + 16 }, 11, 1, RAYWHITE);
+
+    Component::Draw();
+}
+
+void Memory::PlaceConnectors() {
+    float x = rect.x;
+    float y = rect.y;
+    rect.height = std::max<float>(HEIGHT, 10 + 12 * (inConns.size() - 1));
+    for (int i = 0; i < inConns.size(); i++)
+        inConns[i].pos = {x + 5, y + 5 + 12 * i};
+    outConns[0].pos = {x + WIDTH - 5, y + rect.height / 2};
+}
+
+void Memory::Save(std::ostream& s) {
+    Component::Save(s);
+    Write(s, &addrWidth);
+    Write(s, &dataWidth);
+    Write(s, &contents);
+
+    size_t size = inConns.size();
+    Write(s, &size);
+    for (auto& inConn : inConns)
+        inConn.Save(s);
+
+    size = outConns.size();
+    Write(s, &size);
+    for (auto& outConn : outConns)
+        outConn.Save(s);
+}
+
+Block::Block(float x, float y, const char *text, Color color, std::vector<Component *> comps,
+      std::vector<Line *> connections)
+    : Component(x, y, WIDTH, HEIGHT, text, Component::Type::BLOCK), color(color), refCounter(0) {
+
+    for (auto& comp : comps) {
+        this->comps.push_back(comp);
+    }
+    for (auto& line : connections) {
+        this->connections.push_back(line);
+    }
+}
+
+Block::Block(const Block *block)
+    : Component(block), color(block->color), isIcon(false), refCounter(0), arena(block->arena) {
+    numInputs = 0;
+    numOutputs = 0;
+    refCounter += 1;
+
+    for (auto &comp : block->comps) {
+        switch (comp->type) {
+        case Type::INPUT1:
+            numInputs += 1;
+            break;
+        case Type::INPUT2:
+            numInputs += 2;
+            break;
+        case Type::INPUT4:
+            numInputs += 4;
+            break;
+        case Type::INPUT8:
+            numInputs += 8;
+            break;
+        case Type::OUTPUT1:
+            numOutputs += 1;
+            break;
+        case Type::OUTPUT2:
+            numOutputs += 1;
+            break;
+        case Type::OUTPUT4:
+            numOutputs += 1;
+            break;
+        case Type::OUTPUT8:
+            numOutputs += 1;
+            break;
+        }
+        comps.push_back(comp);
+    }
+    for (auto &line : block->connections) {
+        connections.push_back(line);
+    }
+
+    rect.width += 20;
+
+    int inIdx = 0;
+    int outIdx = 0;
+    for (auto& comp : comps) {
+        if (IsInputComponent(comp)) {
+            for (auto& out : comp->outConns) {
+                inConns.push_back({this, {rect.x + 5, 10 + rect.y + 15 * inIdx++}, Connector::Type::IN, &out, out.width});
+            }
+        } else if (IsOutputComponent(comp)) {
+            for (auto& in : comp->inConns) {
+                outConns.push_back({this, {rect.x + rect.width - 5, 10 + rect.y + 15 * outIdx++}, Connector::Type::OUT, &in, in.width});
+            }
+        }
+    }
+
+    rect.height = std::max<float>(HEIGHT, std::max(inConns.size(), outConns.size()) * 15.0 + 10);
+}
+
+Block::Block(Reader& s, Component::Type type) : Component(s, type), refCounter(0) {
+    ReadContents(s);
+}
+
+// The rest of the reader stays unparsed in the buffer that owns it until Load
+void Block::Defer(Reader& s) {
+    if (!s.owner) {
+        ReadContents(s);
+        return;
+    }
+    source = s.owner;
+    sourceOffset = s.data + s.pos - source->data();
+    sourceSize = s.size - s.pos;
+    sourceVersion = s.version;
+}
+
+void Block::Load() {
+    if (!source)
+        return;
+    Reader s(source->data() + sourceOffset, sourceSize);
+    s.version = sourceVersion;
+    s.owner = std::move(source);
+    source = nullptr;
+    ReadContents(s);
+}
+
+void Block::ReadContents(Reader& s) {
+    ReadComponents(s, comps, *arena);
+
+    size_t size;
+    ReadCount(s, &size);
+    connections.reserve(size);
+    for (int i = 0; i < size; i++) {
+        Connector* start = Read(s, connections, comps);
+        Connector* end = Read(s, connections, comps);
+        if (start && end && start->width == end->width)
+            connections.push_back(arena->New<Line>(start, end));
+    }
+    RewireAll(*this);
+
+    ReadCount(s, &size);
+    for (int i = 0; i < size; i++)
+        inConns.push_back(Connector(s, this));
+
+    ReadCount(s, &size);
+    for (int i = 0; i < size; i++)
+        outConns.push_back(Connector(s, this));
+
+    Read(s, &color);
+    Read(s, &isIcon);
+    PlaceConnectors();
+}
+
+void Block::Move(const Vector2 &delta) {
+    rect.x += delta.x;
+    rect.y += delta.y;
+    for (auto& in : inConns) {
+        in.pos.x += delta.x;
+        in.pos.y += delta.y;
+    }
+    for (auto &out : outConns) {
+        out.pos.x += delta.x;
+        out.pos.y += delta.y;
+    }
+}
+
+void Block::PlaceConnectors() {
+    for (int i = 0; i < inConns.size(); i++)
+        inConns[i].pos = {rect.x + 5, 10 + rect.y + 15 * i};
+    for (int i = 0; i < outConns.size(); i++)
+        outConns[i].pos = {rect.x + rect.width - 5, 10 + rect.y + 15 * i};
+}
+
+void Block::Draw() {
+    if (isIcon) {
+        DrawRectangleRounded({rect.x, rect.y, rect.width, rect.height}, 0.3, 5, color);
+        DrawTextEx(font, TextFormat("%.4s", text.c_str()), { rect.x + 3, rect.y + 5 }, 18, 1, RAYWHITE);
+    } else {
+        DrawRectangleRounded({rect.x + 10, rect.y, rect.width - 2 * 10, rect.height}, 0.3, 5, color);
         DrawTextEx(font, TextFormat("%.4s", text.c_str()), { rect.x + 12, rect.y + 5 }, 18, 1, RAYWHITE);
 
-        Vector2 pos = GetMousePosition();
-        for (auto& in : inConns) {
-            Color connColor = in.value ? RED : GRAY;
-            DrawCircle(in.pos.x, in.pos.y, 5, connColor);
+        Vector2 pos = GetMousePosition();
+        for (auto& in : inConns) {
+            Color connColor = ValueColor(in);
+            DrawCircle(in.pos.x, in.pos.y, in.width > 1 ? 6 : 5, connColor);
+
+            if (CheckCollisionPointCircle(pos, in.pos, 5)) {
+                DrawRectangleLines(in.pos.x - 5, in.pos.y - 5, 10, 10, PINK);
+            }
+        }
+        for (auto& out : outConns) {
+            Color connColor = ValueColor(out);
+            DrawCircle(out.pos.x, out.pos.y, out.width > 1 ? 6 : 5, connColor);
+
+            if (CheckCollisionPointCircle(pos, out.pos, 5)) {
+                DrawRectangleLines(out.pos.x - 5, out.pos.y - 5, 10, 10, PINK);
+            }
+        }
+    }
+
+    Component::Draw();
+}
+
+Connector* Block::CheckEndpoints(const Vector2 &pos) {
+    for (auto& in : inConns) {
+        if (CheckCollisionPointRec(pos, {in.pos.x - 5, in.pos.y - 5, 10, 10})) {
+            return &in;
+        }
+    }
+    for (auto& out : outConns) {
+        if (CheckCollisionPointRec(pos, {out.pos.x - 5, out.pos.y - 5, 10, 10})) {
+            return &out;
+        }
+    }
+    return nullptr;
+}
+
+void Block::Save(std::ostream& s) {
+    Component::Save(s);
+    SaveContents(s);
+}
+
+void Block::SaveContents(std::ostream& s) {
+    if (source && sourceVersion != PROJECT_VERSION)
+        Load();
+
+    // Never loaded, so what was read is still what should be written
+    if (source) {
+        s.write(source->data() + sourceOffset, sourceSize);
+        return;
+    }
+
+    size_t size = comps.size();
+    Write(s, &size);
+    for (auto& comp: comps)
+        comp->Save(s);
+
+    ConnectorIndex index = IndexConnectors(comps);
+
+    size = connections.size();
+    Write(s, &size);
+    for (auto& connection : connections) {
+        Write(s, connection->start, index);
+        Write(s, connection->end, index);
+    }
+
+    size = inConns.size();
+    Write(s, &size);
+    for (auto& input : inConns)
+        input.Save(s, &index);
+
+    size = outConns.size();
+    Write(s, &size);
+    for (auto& output : outConns)
+        output.Save(s, &index);
+
+    Write(s, &color);
+    Write(s, &isIcon);
+}
+
+// Lines need no destructor, their memory goes with the arena
+Block::~Block() {
+    if (refCounter == 0) {
+        for (auto &comp : comps) {
+            arena->Delete(comp);
+        }
+        comps.clear();
+        connections.clear();
+    }
+}
+
+// Net of a connector, its own on the board and the one it is mapped to inside an instance
+int NetOf(const Connector* conn, const NetMap* nets) {
+    if (!nets)
+        return conn->net;
+    auto it = nets->find(conn);
+    return it != nets->end() ? it->second : NetState::ZERO;
+}
+
+bool Parity(uint64_t word) {
+    word ^= word >> 32;
+    word ^= word >> 16;
+    word ^= word >> 8;
+    word ^= word >> 4;
+    word ^= word >> 2;
+    word ^= word >> 1;
+    return word & 1;
+}
+
+// Output of a gate from its inputs gathered into one word, input k in bit k
+template <Gate::Type T>
+bool Reduce(uint64_t word, uint64_t mask) {
+    switch (T) {
+    case Gate::Type::AND:
+        return word == mask;
+    case Gate::Type::NAND:
+        return word != mask;
+    case Gate::Type::OR:
+        return word != 0;
+    case Gate::Type::NOR:
+        return word == 0;
+    case Gate::Type::XOR:
+        return Parity(word);
+    case Gate::Type::XNOR:
+        return !Parity(word);
+    case Gate::Type::NOT:
+        return !(word & 1);
+    case Gate::Type::TRI:
+        // Z reads as 0 in two-state mode
+        return (word & 3) == 3;
+    default:
+        return word & 1;
+    }
+}
+
+// One loop per gate type and input count, both known at compile time so the loop has no branches left
+template <Gate::Type T, int N>
+void EvalGates(NetState& nets, const std::vector<int>& pins) {
+    const uint64_t mask = N == 64 ? ~uint64_t(0) : (uint64_t(1) << N) - 1;
+    for (size_t i = 0; i < pins.size(); i += N + 1) {
+        const int* gate = &pins[i];
+        uint64_t word = 0;
+        for (int k = 0; k < N; k++)
+            word |= uint64_t(nets.Get(gate[k])) << k;
+        nets.Set(gate[N], Reduce<T>(word, mask));
+    }
+}
+
+// Input counts without a loop of their own
+template <Gate::Type T>
+void EvalGates(NetState& nets, const std::vector<int>& pins, int numInputs) {
+    const uint64_t mask = numInputs == 64 ? ~uint64_t(0) : (uint64_t(1) << numInputs) - 1;
+    for (size_t i = 0; i < pins.size(); i += numInputs + 1) {
+        const int* gate = &pins[i];
+        uint64_t word = 0;
+        for (int k = 0; k < numInputs; k++)
+            word |= uint64_t(nets.Get(gate[k])) << k;
+        nets.Set(gate[numInputs], Reduce<T>(word, mask));
+    }
+}
+
+// Four-state output as its level, from the value and unknown bits of the inputs. Z reads as X on an input,
+// a known controlling input still decides the output.
+template <Gate::Type T>
+int Reduce4(uint64_t word, uint64_t unknown, uint64_t mask) {
+    uint64_t known = ~unknown & mask;
+    int level;
+    switch (T) {
+    case Gate::Type::AND:
+    case Gate::Type::NAND:
+        level = (~word & known) ? NetState::LOW : unknown ? NetState::X : NetState::HIGH;
+        break;
+    case Gate::Type::OR:
+    case Gate::Type::NOR:
+        level = (word & known) ? NetState::HIGH : unknown ? NetState::X : NetState::LOW;
+        break;
+    case Gate::Type::XOR:
+    case Gate::Type::XNOR:
+        level = unknown ? NetState::X : Parity(word);
+        break;
+    case Gate::Type::NOT:
+        level = unknown ? NetState::X : !(word & 1);
+        break;
+    case Gate::Type::TRI:
+        if (unknown & 2)
+            return NetState::X;
+        if (!(word & 2))
+            return NetState::HIGH_Z;
+        return unknown & 1 ? NetState::X : word & 1;
+    default:
+        // A buffer is a piece of wire, it passes Z on
+        return (word & 1) | (unknown & 1) << 1;
+    }
+    if ((T == Gate::Type::NAND || T == Gate::Type::NOR || T == Gate::Type::XNOR) && level != NetState::X)
+        level = !level;
+    return level;
+}
+
+template <Gate::Type T>
+void EvalGates4(NetState& nets, const std::vector<int>& pins, int numInputs) {
+    const uint64_t mask = NetState::Mask(numInputs);
+    for (size_t i = 0; i < pins.size(); i += numInputs + 1) {
+        const int* gate = &pins[i];
+        uint64_t word = 0;
+        uint64_t unknown = 0;
+        for (int k = 0; k < numInputs; k++) {
+            word |= uint64_t(nets.Get(gate[k])) << k;
+            unknown |= uint64_t(nets.Unknown(gate[k])) << k;
+        }
+        int level = Reduce4<T>(word, unknown, mask);
+        nets.Set(gate[numInputs], level & 1);
+        nets.SetUnknown(gate[numInputs], level >> 1);
+    }
+}
+
+template <Gate::Type T>
+void EvalGroup(NetState& nets, const std::vector<int>& pins, int numInputs) {
+    if (nets.fourState) {
+        EvalGates4<T>(nets, pins, numInputs);
+        return;
+    }
+    switch (numInputs) {
+    case 1:
+        EvalGates<T, 1>(nets, pins);
+        break;
+    case 2:
+        EvalGates<T, 2>(nets, pins);
+        break;
+    case 3:
+        EvalGates<T, 3>(nets, pins);
+        break;
+    case 4:
+        EvalGates<T, 4>(nets, pins);
+        break;
+    case 8:
+        EvalGates<T, 8>(nets, pins);
+        break;
+    default:
+        EvalGates<T>(nets, pins, numInputs);
+        break;
+    }
+}
+
+void Engine::Clear() {
+    for (auto net : ownNets)
+        Connector::nets.Remove(net);
+    ownNets.clear();
+    Connector::nets.ClearCompiled();
+    nodes.clear();
+    groups.clear();
+    macros.clear();
+    fixed.clear();
+    owners.clear();
+    criticalDelay = 0;
+    criticalLoop = false;
+    criticalPath.clear();
+    criticalNets.clear();
+    loopNets.clear();
+    board = nullptr;
+    dirty = true;
+}
+
+void Engine::ForgetMemory(const Memory* memory) {
+    for (auto it = instanceMemories.begin(); it != instanceMemories.end();) {
+        if (it->first.back() == memory)
+            it = instanceMemories.erase(it);
+        else
+            ++it;
+    }
+}
+
+void Engine::Compile(Block& board) {
+    Clear();
+    this->board = &board;
+    AddComponents(board, nullptr);
+    // Timing is that of the board as drawn, before gates are folded or left out
+    Analyze();
+    Optimize();
+    // RAM of instances no longer on the board is dropped
+    for (auto it = instanceMemories.begin(); it != instanceMemories.end();) {
+        if (it->first[0] == &board && !it->second.used)
+            it = instanceMemories.erase(it);
+        else
+            (it++)->second.used = false;
+    }
+
+    // A gate's level is one more than that of the gates driving it, gates left in loops come last
+    std::unordered_map<int, int> drivers;
+    std::vector<int> order;
+    std::vector<std::vector<int>> fanout;
+    Sort(drivers, order, fanout);
+    std::vector<int> level(nodes.size(), 0);
+    std::vector<bool> sorted(nodes.size(), false);
+    int maxLevel = 0;
+    for (auto i : order) {
+        sorted[i] = true;
+        maxLevel = std::max(maxLevel, level[i]);
+        for (auto next : fanout[i])
+            level[next] = std::max(level[next], level[i] + 1);
+    }
+    for (int i = 0; i < nodes.size(); i++) {
+        if (!sorted[i])
+            level[i] = maxLevel + 1;
+    }
+
+    std::vector<int> byLevel(nodes.size());
+    std::iota(byLevel.begin(), byLevel.end(), 0);
+    std::stable_sort(byLevel.begin(), byLevel.end(), [&](int a, int b) {
+        if (level[a] != level[b])
+            return level[a] < level[b];
+        if ((nodes[a].macro >= 0) != (nodes[b].macro >= 0))
+            return nodes[a].macro < 0;
+        if (nodes[a].type != nodes[b].type)
+            return nodes[a].type < nodes[b].type;
+        return nodes[a].ins.size() < nodes[b].ins.size();
+    });
+    int groupLevel = -1;
+    for (auto i : byLevel) {
+        Node& node = nodes[i];
+        if (node.macro >= 0) {
+            if (groups.empty() || groupLevel != level[i] || groups.back().macros.empty()) {
+                groups.push_back({ Gate::Type::BUF, 0, {}, {} });
+                groupLevel = level[i];
+            }
+            groups.back().macros.push_back(node.macro);
+            continue;
+        }
+        if (groups.empty() || !groups.back().macros.empty() || groupLevel != level[i] || groups.back().type != node.type ||
+            groups.back().numInputs != node.ins.size()) {
+            groups.push_back({ node.type, (int)node.ins.size(), {}, {} });
+            groupLevel = level[i];
+        }
+        auto& pins = groups.back().pins;
+        pins.insert(pins.end(), node.ins.begin(), node.ins.end());
+        pins.push_back(node.out);
+    }
+    // Freeing any other net leaves the compiled code as it is
+    for (auto& node : nodes) {
+        for (auto net : node.ins)
+            Connector::nets.SetCompiled(net);
+        if (node.macro < 0)
+            Connector::nets.SetCompiled(node.out);
+    }
+    for (auto& op : macros) {
+        for (auto& port : op.ins) {
+            for (int b = 0; b < port.width; b++)
+                Connector::nets.SetCompiled(port.net + b);
+        }
+        for (auto& port : op.outs) {
+            for (int b = 0; b < port.width; b++)
+                Connector::nets.SetCompiled(port.net + b);
+        }
+    }
+    if (timed)
+        CompileTimed();
+    else
+        nodes.clear();
+
+    if (unknownRegisters) {
+        for (auto& op : macros) {
+            if (op.kind == Macro::Kind::REG) {
+                Connector::nets.SetWord(op.outs[0].net, op.outs[0].width, ~uint64_t(0));
+                Connector::nets.SetUnknownWord(op.outs[0].net, op.outs[0].width, ~uint64_t(0));
+            }
+        }
+        unknownRegisters = false;
+    }
+
+    dirty = false;
+    compiledAt = Connector::nets.removed;
+    fourState = Connector::nets.fourState;
+}
+
+// Drivers of every net and the nodes reading each node's outputs. The order has every node after the ones
+// driving it, nodes in loops and after them are left out.
+void Engine::Sort(std::unordered_map<int, int>& drivers, std::vector<int>& order, std::vector<std::vector<int>>& fanout) const {
+    for (int i = 0; i < nodes.size(); i++) {
+        if (nodes[i].macro < 0) {
+            drivers[nodes[i].out] = i;
+            continue;
+        }
+        for (auto& out : macros[nodes[i].macro].outs) {
+            for (int b = 0; b < out.width; b++)
+                drivers[out.net + b] = i;
+        }
+    }
+    std::vector<int> pending(nodes.size(), 0);
+    fanout.assign(nodes.size(), {});
+    for (int i = 0; i < nodes.size(); i++) {
+        for (auto net : nodes[i].ins) {
+            auto it = drivers.find(net);
+            if (it != drivers.end()) {
+                pending[i]++;
+                fanout[it->second].push_back(i);
+            }
+        }
+    }
+    order.clear();
+    order.reserve(nodes.size());
+    for (int i = 0; i < nodes.size(); i++) {
+        if (pending[i] == 0)
+            order.push_back(i);
+    }
+    for (size_t k = 0; k < order.size(); k++) {
+        for (auto next : fanout[order[k]]) {
+            if (--pending[next] == 0)
+                order.push_back(next);
+        }
+    }
+}
+
+// A node's output arrives its delay after the latest of its inputs, taken in topological order so every node
+// is seen once. Nets nothing drives arrive at 0. Nodes in loops have no arrival, their nets are flagged and
+// outputs depending on them are left out of the path.
+void Engine::Analyze() {
+    criticalDelay = 0;
+    criticalLoop = false;
+    criticalPath.clear();
+    criticalNets.clear();
+    loopNets.clear();
+    std::unordered_map<int, int> drivers;
+    std::vector<int> order;
+    std::vector<std::vector<int>> fanout;
+    Sort(drivers, order, fanout);
+    auto driverOf = [&](int net) {
+        auto it = drivers.find(net);
+        return it == drivers.end() ? -1 : it->second;
+    };
+    // The latest input of each node and the node driving it
+    std::vector<int> arrival(nodes.size(), 0);
+    std::vector<int> fromNet(nodes.size(), -1);
+    std::vector<int> fromNode(nodes.size(), -1);
+    std::vector<bool> timed(nodes.size(), false);
+    for (auto i : order) {
+        int latest = 0;
+        for (auto net : nodes[i].ins) {
+            int driver = driverOf(net);
+            int time = driver < 0 ? 0 : arrival[driver];
+            if (fromNet[i] < 0 || time > latest) {
+                latest = time;
+                fromNet[i] = net;
+                fromNode[i] = driver;
+            }
+        }
+        arrival[i] = latest + nodes[i].delay;
+        timed[i] = true;
+    }
+
+    // Loops are the strongly connected parts of what was left out, found with Tarjan's algorithm
+    if (order.size() < nodes.size()) {
+        std::vector<int> index(nodes.size(), -1);
+        std::vector<int> low(nodes.size(), 0);
+        std::vector<bool> onStack(nodes.size(), false);
+        std::vector<int> stack;
+        std::vector<std::pair<int, size_t>> calls;
+        int counter = 0;
+        auto visit = [&](int i) {
+            index[i] = low[i] = counter++;
+            stack.push_back(i);
+            onStack[i] = true;
+            calls.push_back({ i, 0 });
+        };
+        for (int root = 0; root < nodes.size(); root++) {
+            if (timed[root] || index[root] >= 0)
+                continue;
+            visit(root);
+            while (!calls.empty()) {
+                int i = calls.back().first;
+                size_t k = calls.back().second++;
+                if (k < fanout[i].size()) {
+                    int next = fanout[i][k];
+                    if (index[next] < 0)
+                        visit(next);
+                    else if (onStack[next])
+                        low[i] = std::min(low[i], index[next]);
+                    continue;
+                }
+                calls.pop_back();
+                if (!calls.empty())
+                    low[calls.back().first] = std::min(low[calls.back().first], low[i]);
+                if (low[i] != index[i])
+                    continue;
+                size_t first = std::find(stack.begin(), stack.end(), i) - stack.begin();
+                bool loop = stack.size() - first > 1 || std::count(fanout[i].begin(), fanout[i].end(), i);
+                for (size_t j = first; j < stack.size(); j++) {
+                    int member = stack[j];
+                    onStack[member] = false;
+                    if (!loop)
+                        continue;
+                    if (nodes[member].macro < 0) {
+                        loopNets.insert(nodes[member].out);
+                        continue;
+                    }
+                    for (auto& out : macros[nodes[member].macro].outs) {
+                        for (int b = 0; b < out.width; b++)
+                            loopNets.insert(out.net + b);
+                    }
+                }
+                stack.resize(first);
+            }
+        }
+    }
+
+    // The path ends at the output bit that arrives last
+    int end = -1;
+    int endNet = -1;
+    const Component* endComp = nullptr;
+    for (auto& comp : board->comps) {
+        if (!IsOutputComponent(comp))
+            continue;
+        for (auto& in : comp->inConns) {
+            int net = NetOf(&in, nullptr);
+            for (int b = 0; b < in.width; b++) {
+                int driver = driverOf(net + b);
+                if (driver >= 0 && !timed[driver])
+                    criticalLoop = true;
+                else if (driver >= 0 && (end < 0 || arrival[driver] > arrival[end])) {
+                    end = driver;
+                    endNet = net + b;
+                    endComp = comp;
+                }
+            }
+        }
+    }
+    if (end < 0)
+        return;
 
-            if (CheckCollisionPointCircle(pos, in.pos, 5)) {
-                DrawRectangleLines(in.pos.x - 5, in.pos.y - 5, 10, 10, PINK);
+    criticalDelay = arrival[end];
+    criticalNets.insert(endNet);
+    criticalPath.push_back({ endComp });
+    int start = -1;
+    for (int i = end; i >= 0; i = fromNode[i]) {
+        if (nodes[i].owner >= 0 && owners[nodes[i].owner] != criticalPath.back())
+            criticalPath.push_back(owners[nodes[i].owner]);
+        if (fromNet[i] >= 0 && fromNet[i] != NetState::ZERO)
+            criticalNets.insert(fromNet[i]);
+        start = fromNet[i];
+    }
+    for (auto& comp : board->comps) {
+        if (!IsInputComponent(comp))
+            continue;
+        for (auto& out : comp->outConns) {
+            if (start >= out.net && start < out.net + out.width)
+                criticalPath.push_back({ comp });
+        }
+    }
+    std::reverse(criticalPath.begin(), criticalPath.end());
+    // Wires taking a bus out of a block belong to the instance, the component inside that drives them is enough
+    auto within = [](const std::vector<const Component*>& outer, const std::vector<const Component*>& inner) {
+        return outer.size() < inner.size() && std::equal(outer.begin(), outer.end(), inner.begin());
+    };
+    std::vector<std::vector<const Component*>> steps;
+    for (size_t k = 0; k < criticalPath.size(); k++) {
+        if ((k > 0 && within(criticalPath[k], criticalPath[k - 1])) ||
+            (k + 1 < criticalPath.size() && within(criticalPath[k], criticalPath[k + 1])))
+            continue;
+        steps.push_back(criticalPath[k]);
+    }
+    criticalPath = std::move(steps);
+}
+
+void Engine::AddComponents(Block& block, const NetMap* nets) {
+    for (auto& comp : block.comps) {
+        size_t first = nodes.size();
+        path.push_back(comp);
+        indices.push_back(&comp - block.comps.data());
+        if (comp->type == Component::Type::GATE) {
+            Gate* gate = static_cast<Gate*>(comp);
+            Node node{ gate->gateType, {}, NetOf(&comp->outConns[0], nets), -1, gate->delay };
+            for (auto& in : comp->inConns)
+                node.ins.push_back(NetOf(&in, nets));
+            nodes.push_back(std::move(node));
+        } else if (comp->type == Component::Type::BLOCK) {
+            AddInstance(*static_cast<Block*>(comp), nets);
+        } else if (comp->type == Component::Type::MACRO) {
+            AddMacro(*static_cast<Macro*>(comp), nets);
+        } else if (comp->type == Component::Type::RAM || comp->type == Component::Type::ROM) {
+            AddMemory(*static_cast<Memory*>(comp), nets);
+        } else if (comp->type == Component::Type::SPLITTER || comp->type == Component::Type::MERGER) {
+            // Each bit is copied on its own, the first bit connector is the highest bit of the bus
+            Splitter* splitter = static_cast<Splitter*>(comp);
+            int width = splitter->Width();
+            int bus = NetOf(&splitter->Bus(), nets);
+            for (int i = 0; i < width; i++) {
+                int bit = NetOf(&splitter->Bits()[i], nets);
+                if (splitter->Merger())
+                    nodes.push_back({ Gate::Type::BUF, { bit }, bus + width - 1 - i, -1, 0 });
+                else
+                    nodes.push_back({ Gate::Type::BUF, { bus + width - 1 - i }, bit, -1, 0 });
             }
         }
-        for (auto& out : outConns) {
-            Color connColor = out.value ? RED : GRAY;
-            DrawCircle(out.pos.x, out.pos.y, 5, connColor);
+        // What the components inside a block instance made is theirs, the rest belongs to this one
+        if (first < nodes.size()) {
+            for (size_t i = first; i < nodes.size(); i++) {
+                if (nodes[i].owner < 0)
+                    nodes[i].owner = owners.size();
+            }
+            owners.push_back(path);
+        }
+        path.pop_back();
+        indices.pop_back();
+    }
+    AddResolvers(block, nets);
+}
 
-            if (CheckCollisionPointCircle(pos, out.pos, 5)) {
-                DrawRectangleLines(out.pos.x - 5, out.pos.y - 5, 10, 10, PINK);
+// Instances share their components with the library block, so their nets are looked up in a map
+void Engine::AddInstance(Block& instance, const NetMap* outer) {
+    NetMap inner;
+    for (auto& in : instance.inConns) {
+        if (in.conn)
+            inner[in.conn] = NetOf(&in, outer);
+    }
+    for (auto& comp : instance.comps) {
+        if (IsInputComponent(comp))
+            continue;
+        for (auto& out : comp->outConns) {
+            int net = Connector::nets.AddRange(out.width);
+            for (int i = 0; i < out.width; i++)
+                ownNets.push_back(net + i);
+            inner[&out] = net;
+        }
+    }
+    std::unordered_map<const Connector*, int> drivers;
+    for (auto& line : instance.connections)
+        drivers[line->end]++;
+    for (auto& line : instance.connections) {
+        if (drivers[line->end] == 1) {
+            inner[line->end] = NetOf(line->start, &inner);
+        } else if (!inner.count(line->end)) {
+            int net = Connector::nets.AddRange(line->end->width);
+            for (int i = 0; i < line->end->width; i++)
+                ownNets.push_back(net + i);
+            inner[line->end] = net;
+        }
+    }
+
+    AddComponents(instance, &inner);
+
+    for (auto& out : instance.outConns) {
+        if (!out.conn)
+            continue;
+        int from = NetOf(out.conn, &inner);
+        int to = NetOf(&out, outer);
+        for (int i = 0; i < out.width; i++)
+            nodes.push_back({ Gate::Type::BUF, { from + i }, to + i, -1, 0 });
+    }
+}
+
+// A macro depends on every bit it reads, except for a register that only waits for its clock
+void Engine::AddMacro(Macro& macro, const NetMap* nets) {
+    MacroOp op{ macro.kind, {}, {} };
+    for (auto& in : macro.inConns)
+        op.ins.push_back({ NetOf(&in, nets), in.width });
+    for (auto& out : macro.outConns)
+        op.outs.push_back({ NetOf(&out, nets), out.width });
+
+    Node node{ Gate::Type::BUF, {}, NetState::ZERO, (int)macros.size(), 0 };
+    for (int i = macro.kind == Macro::Kind::REG ? 1 : 0; i < op.ins.size(); i++) {
+        for (int b = 0; b < op.ins[i].width; b++)
+            node.ins.push_back(op.ins[i].net + b);
+    }
+    if (macro.kind == Macro::Kind::REG)
+        op.clock = Connector::nets.Get(op.ins[1].net);
+    macros.push_back(std::move(op));
+    nodes.push_back(std::move(node));
+}
+
+// Reading depends on the address, writing waits for the clock like a register
+void Engine::AddMemory(Memory& memory, const NetMap* nets) {
+    MacroOp op{ memory.Rom() ? Macro::Kind::ROM : Macro::Kind::RAM, {}, {} };
+    for (auto& in : memory.inConns)
+        op.ins.push_back({ NetOf(&in, nets), in.width });
+    op.outs.push_back({ NetOf(&memory.outConns[0], nets), memory.outConns[0].width });
+    op.wordBytes = memory.WordBytes();
+    // Instances of a block share its components, each one gets a RAM of its own
+    if (nets && !memory.Rom()) {
+        std::vector<const Component*> key{ board };
+        key.insert(key.end(), path.begin(), path.end());
+        auto it = instanceMemories.find(key);
+        if (it == instanceMemories.end()) {
+            auto saved = board == savedBoard ? savedMemories.find(indices) : savedMemories.end();
+            it = instanceMemories.emplace(key, InstanceMemory{ indices, memory.contents }).first;
+            if (saved != savedMemories.end()) {
+                it->second.contents = std::move(saved->second);
+                savedMemories.erase(saved);
             }
         }
+        it->second.indices = indices;
+        it->second.used = true;
+        op.data = &it->second.contents;
+    } else {
+        op.data = &memory.contents;
     }
 
-    Component::Draw();
+    Node node{ Gate::Type::BUF, {}, NetState::ZERO, (int)macros.size(), 0 };
+    for (int b = 0; b < op.ins[0].width; b++)
+        node.ins.push_back(op.ins[0].net + b);
+    if (!memory.Rom()) {
+        node.ins.push_back(op.ins[3].net);
+        op.clock = Connector::nets.Get(op.ins[3].net);
+    }
+    macros.push_back(std::move(op));
+    nodes.push_back(std::move(node));
 }
 
-Connector* Block::CheckEndpoints(const Vector2 &pos) {
-    for (auto& in : inConns) {
-        if (CheckCollisionPointRec(pos, {in.pos.x - 5, in.pos.y - 5, 10, 10})) {
-            return &in;
+// Inputs with more than one driver get a node resolving them, in the order of their lines
+void Engine::AddResolvers(Block& block, const NetMap* nets) {
+    std::unordered_map<const Connector*, int> drivers;
+    for (auto& line : block.connections)
+        drivers[line->end]++;
+    // Node of each input resolved
+    std::unordered_map<const Connector*, int> resolvers;
+    for (auto& line : block.connections) {
+        Connector* end = line->end;
+        if (drivers[end] < 2)
+            continue;
+        auto it = resolvers.find(end);
+        if (it == resolvers.end()) {
+            macros.push_back({ Macro::Kind::RESOLVE, {}, { { NetOf(end, nets), end->width } } });
+            nodes.push_back({ Gate::Type::BUF, {}, NetState::ZERO, (int)macros.size() - 1, 0, (int)owners.size() });
+            owners.push_back(path);
+            owners.back().push_back(end->parent);
+            it = resolvers.emplace(end, (int)nodes.size() - 1).first;
         }
+        Node& node = nodes[it->second];
+        int driver = NetOf(line->start, nets);
+        macros[node.macro].ins.push_back({ driver, end->width });
+        for (int b = 0; b < end->width; b++)
+            node.ins.push_back(driver + b);
     }
-    for (auto& out : outConns) {
-        if (CheckCollisionPointRec(pos, {out.pos.x - 5, out.pos.y - 5, 10, 10})) {
-            return &out;
+}
+
+void Engine::RunMacro(MacroOp& op, NetState& nets) {
+    auto in = [&](int i) { return nets.GetWord(op.ins[i].net, op.ins[i].width); };
+    auto out = [&](int i, uint64_t value) { nets.DriveWord(op.outs[i].net, op.outs[i].width, value); };
+    // Both bit planes, in four-state mode
+    auto unknown = [&](int i) { return nets.fourState ? nets.GetUnknownWord(op.ins[i].net, op.ins[i].width) : 0; };
+    auto outLevels = [&](int i, uint64_t value, uint64_t unknown) {
+        nets.SetWord(op.outs[i].net, op.outs[i].width, value);
+        nets.SetUnknownWord(op.outs[i].net, op.outs[i].width, unknown);
+    };
+    int width = op.ins[0].width;
+
+    // Arithmetic gives X on every output bit as soon as one input bit is unknown
+    if (nets.fourState && op.kind != Macro::Kind::MUX && op.kind != Macro::Kind::REG && op.kind != Macro::Kind::RAM &&
+        op.kind != Macro::Kind::RESOLVE) {
+        for (int i = 0; i < op.ins.size(); i++) {
+            if (unknown(i)) {
+                for (int k = 0; k < op.outs.size(); k++)
+                    outLevels(k, ~uint64_t(0), ~uint64_t(0));
+                return;
+            }
         }
     }
-    return nullptr;
+
+    switch (op.kind) {
+    case Macro::Kind::ADD: {
+        uint64_t a = in(0);
+        uint64_t sum = a + in(1) + in(2);
+        // At 64 bits the carry is the wrap around
+        bool carry = width < 64 ? sum >> width & 1 : sum < a || (sum == a && (in(1) || in(2)));
+        out(0, sum);
+        out(1, carry);
+        break;
+    }
+    case Macro::Kind::SUB: {
+        uint64_t a = in(0);
+        uint64_t b = in(1);
+        uint64_t borrowIn = in(2);
+        out(0, a - b - borrowIn);
+        out(1, a < b || a - b < borrowIn);
+        break;
+    }
+    case Macro::Kind::CMP: {
+        uint64_t a = in(0);
+        uint64_t b = in(1);
+        out(0, a < b);
+        out(1, a == b);
+        out(2, a > b);
+        break;
+    }
+    case Macro::Kind::MUX:
+        if (unknown(2))
+            outLevels(0, ~uint64_t(0), ~uint64_t(0));
+        else
+            outLevels(0, in(2) ? in(1) : in(0), in(2) ? unknown(1) : unknown(0));
+        break;
+    case Macro::Kind::DEC:
+        out(0, uint64_t(1) << in(0));
+        break;
+    case Macro::Kind::SHF: {
+        uint64_t n = in(1);
+        if (n >= width)
+            out(0, 0);
+        else
+            out(0, in(2) ? in(0) >> n : in(0) << n);
+        break;
+    }
+    case Macro::Kind::REG: {
+        // An unknown clock makes no edge
+        bool clock = in(1) && !unknown(1);
+        if (clock && !op.clock)
+            outLevels(0, in(0), unknown(0));
+        op.clock = clock;
+        break;
+    }
+    case Macro::Kind::RAM: {
+        // Contents are two-state, a write with an unknown address or enable is skipped
+        bool clock = in(3) && !unknown(3);
+        if (clock && !op.clock && in(2) && !unknown(2) && !unknown(0))
+            Memory::Store(*op.data, in(0), op.wordBytes, in(1));
+        op.clock = clock;
+        if (unknown(0))
+            outLevels(0, ~uint64_t(0), ~uint64_t(0));
+        else
+            out(0, Memory::Load(*op.data, in(0), op.wordBytes));
+        break;
+    }
+    case Macro::Kind::ROM:
+        out(0, Memory::Load(*op.data, in(0), op.wordBytes));
+        break;
+    case Macro::Kind::RESOLVE: {
+        // Wired OR in two-state mode. In four-state mode Z gives way to any driver and drivers that
+        // disagree make X, bit by bit.
+        uint64_t any0 = 0;
+        uint64_t any1 = 0;
+        uint64_t anyX = 0;
+        for (int i = 0; i < op.ins.size(); i++) {
+            uint64_t value = in(i);
+            uint64_t unknownBits = unknown(i);
+            any0 |= ~value & ~unknownBits;
+            any1 |= value & ~unknownBits;
+            anyX |= value & unknownBits;
+        }
+        uint64_t x = anyX | (any0 & any1);
+        uint64_t z = ~(any0 | any1 | anyX);
+        if (nets.fourState)
+            outLevels(0, any1 | x, x | z);
+        else
+            out(0, any1);
+        break;
+    }
+    }
 }
 
-void Block::Save(std::ofstream& s) {
-    Component::Save(s);
+// Level of a gate's output from its inputs now, in four-state mode or not
+template <Gate::Type T>
+int GateLevel(NetState& nets, const std::vector<int>& ins) {
+    uint64_t word = 0;
+    uint64_t unknown = 0;
+    for (int k = 0; k < ins.size(); k++) {
+        word |= uint64_t(nets.Get(ins[k])) << k;
+        unknown |= uint64_t(nets.Unknown(ins[k])) << k;
+    }
+    uint64_t mask = NetState::Mask(ins.size());
+    return nets.fourState ? Reduce4<T>(word, unknown, mask) : Reduce<T>(word, mask);
+}
 
-    size_t size = comps.size();
-    Write(s, &size);
-    for (auto& comp: comps)
-        comp->Save(s);
+int GateLevel(NetState& nets, Gate::Type type, const std::vector<int>& ins) {
+    switch (type) {
+    case Gate::Type::NOT:
+        return GateLevel<Gate::Type::NOT>(nets, ins);
+    case Gate::Type::AND:
+        return GateLevel<Gate::Type::AND>(nets, ins);
+    case Gate::Type::OR:
+        return GateLevel<Gate::Type::OR>(nets, ins);
+    case Gate::Type::XOR:
+        return GateLevel<Gate::Type::XOR>(nets, ins);
+    case Gate::Type::NAND:
+        return GateLevel<Gate::Type::NAND>(nets, ins);
+    case Gate::Type::NOR:
+        return GateLevel<Gate::Type::NOR>(nets, ins);
+    case Gate::Type::XNOR:
+        return GateLevel<Gate::Type::XNOR>(nets, ins);
+    case Gate::Type::TRI:
+        return GateLevel<Gate::Type::TRI>(nets, ins);
+    default:
+        return GateLevel<Gate::Type::BUF>(nets, ins);
+    }
+}
 
-    size = connections.size();
-    Write(s, &size);
-    for (auto& connection : connections) {
-        Write(s, connection->start, connections, comps);
-        Write(s, connection->end, connections, comps);
+int LevelOf(NetState& nets, int net) {
+    return nets.fourState ? nets.GetLevel(net) : nets.Get(net);
+}
+
+void SetLevel(NetState& nets, int net, int level) {
+    nets.Set(net, level & 1);
+    nets.SetUnknown(net, level >> 1);
+}
+
+// Shrinks the netlist before it is levelized, the board itself is left as it is. Gates and macros fixed by
+// constant inputs are worked out once and their outputs held at that level, two inverters in a row become a
+// wire, and what no output of the board, register or RAM depends on is left out and held at X.
+void Engine::Optimize() {
+    NetState& nets = Connector::nets;
+    std::unordered_map<int, int> drivers;
+    std::unordered_map<int, std::vector<int>> readers;
+    for (int i = 0; i < nodes.size(); i++) {
+        if (nodes[i].macro < 0) {
+            drivers[nodes[i].out] = i;
+        } else {
+            for (auto& out : macros[nodes[i].macro].outs) {
+                for (int b = 0; b < out.width; b++)
+                    drivers[out.net + b] = i;
+            }
+        }
+        for (auto net : nodes[i].ins)
+            readers[net].push_back(i);
+    }
+    std::vector<bool> removed(nodes.size(), false);
+
+    // Unconnected inputs are on the reserved word, the outputs of gates and macros fixed by them follow.
+    // Both bit planes are taken as they are, so X and Z fold too in four-state mode.
+    std::unordered_set<int> constants;
+    auto constant = [&](int net) { return net >> 6 == 0 || constants.count(net); };
+    auto fixedLevel = [&](const Node& node) {
+        bool all = true;
+        for (auto net : node.ins) {
+            if (!constant(net)) {
+                all = false;
+                continue;
+            }
+            int level = LevelOf(nets, net);
+            if ((node.type == Gate::Type::AND || node.type == Gate::Type::NAND) && level == NetState::LOW)
+                return node.type == Gate::Type::AND ? (int)NetState::LOW : (int)NetState::HIGH;
+            if ((node.type == Gate::Type::OR || node.type == Gate::Type::NOR) && level == NetState::HIGH)
+                return node.type == Gate::Type::OR ? (int)NetState::HIGH : (int)NetState::LOW;
+        }
+        return all ? GateLevel(nets, node.type, node.ins) : -1;
+    };
+    // Registers and memories keep state, their outputs are never fixed
+    auto fixedMacro = [&](const MacroOp& op) {
+        if (op.kind == Macro::Kind::REG || op.kind == Macro::Kind::RAM || op.kind == Macro::Kind::ROM)
+            return false;
+        for (auto& in : op.ins) {
+            for (int b = 0; b < in.width; b++) {
+                if (!constant(in.net + b))
+                    return false;
+            }
+        }
+        return true;
+    };
+    auto fix = [&](int net, int level, std::vector<int>& work) {
+        SetLevel(nets, net, level);
+        fixed.push_back({ net, level });
+        constants.insert(net);
+        auto it = readers.find(net);
+        if (it != readers.end())
+            work.insert(work.end(), it->second.begin(), it->second.end());
+    };
+    std::vector<int> work(nodes.size());
+    std::iota(work.begin(), work.end(), 0);
+    while (!work.empty()) {
+        int i = work.back();
+        work.pop_back();
+        if (removed[i])
+            continue;
+        if (nodes[i].macro >= 0) {
+            MacroOp& op = macros[nodes[i].macro];
+            if (!fixedMacro(op))
+                continue;
+            RunMacro(op, nets);
+            removed[i] = true;
+            for (auto& out : op.outs) {
+                for (int b = 0; b < out.width; b++)
+                    fix(out.net + b, LevelOf(nets, out.net + b), work);
+            }
+            continue;
+        }
+        int level = fixedLevel(nodes[i]);
+        if (level < 0)
+            continue;
+        removed[i] = true;
+        fix(nodes[i].out, level, work);
     }
 
-    size = inConns.size();
-    Write(s, &size);
-    for (auto& input : inConns)
-        input.Save(s);
+    // Not twice is a wire, also across the wires of splitters and block boundaries. Not in four-state mode,
+    // where it turns Z into X, nor in timed simulation, where its two delays make the pulses that are shown.
+    if (!nets.fourState && !timed) {
+        auto wiredFrom = [&](int net) {
+            for (int steps = 0; steps < nodes.size(); steps++) {
+                auto it = drivers.find(net);
+                if (it == drivers.end() || removed[it->second])
+                    break;
+                Node& wire = nodes[it->second];
+                if (wire.macro >= 0 || wire.type != Gate::Type::BUF || wire.ins.size() != 1)
+                    break;
+                net = wire.ins[0];
+            }
+            return net;
+        };
+        for (int i = 0; i < nodes.size(); i++) {
+            Node& node = nodes[i];
+            if (removed[i] || node.macro >= 0 || node.type != Gate::Type::NOT)
+                continue;
+            auto it = drivers.find(wiredFrom(node.ins[0]));
+            if (it == drivers.end() || removed[it->second])
+                continue;
+            Node& first = nodes[it->second];
+            if (first.macro >= 0 || first.type != Gate::Type::NOT)
+                continue;
+            node.type = Gate::Type::BUF;
+            node.ins = { first.ins[0] };
+        }
+    }
 
-    size = outConns.size();
-    Write(s, &size);
-    for (auto& output : outConns)
-        output.Save(s);
+    // Live nodes lead to an output of the board, or to a register or RAM, whose state is seen later on
+    std::vector<bool> live(nodes.size(), false);
+    std::vector<int> stack;
+    auto reach = [&](int net) {
+        auto it = drivers.find(net);
+        if (it != drivers.end() && !removed[it->second] && !live[it->second]) {
+            live[it->second] = true;
+            stack.push_back(it->second);
+        }
+    };
+    for (auto& comp : board->comps) {
+        if (!IsOutputComponent(comp))
+            continue;
+        for (auto& in : comp->inConns) {
+            int net = NetOf(&in, nullptr);
+            for (int b = 0; b < in.width; b++)
+                reach(net + b);
+        }
+    }
+    for (int i = 0; i < nodes.size(); i++) {
+        if (removed[i] || nodes[i].macro < 0)
+            continue;
+        Macro::Kind kind = macros[nodes[i].macro].kind;
+        if (!live[i] && (kind == Macro::Kind::REG || kind == Macro::Kind::RAM)) {
+            live[i] = true;
+            stack.push_back(i);
+        }
+    }
+    while (!stack.empty()) {
+        int i = stack.back();
+        stack.pop_back();
+        // A node of a register or RAM leaves out the inputs read on the clock edge, the macro has them all
+        if (nodes[i].macro < 0) {
+            for (auto net : nodes[i].ins)
+                reach(net);
+        } else {
+            for (auto& in : macros[nodes[i].macro].ins) {
+                for (int b = 0; b < in.width; b++)
+                    reach(in.net + b);
+            }
+        }
+    }
 
-    Write(s, &color);
-    Write(s, &isIcon);
+    // What is left out shows as unknown instead of a value that is never worked out again
+    size_t kept = 0;
+    for (size_t i = 0; i < nodes.size(); i++) {
+        if (!live[i]) {
+            if (!removed[i] && nodes[i].macro < 0) {
+                fixed.push_back({ nodes[i].out, NetState::X });
+            } else if (!removed[i]) {
+                for (auto& out : macros[nodes[i].macro].outs) {
+                    for (int b = 0; b < out.width; b++)
+                        fixed.push_back({ out.net + b, NetState::X });
+                }
+            }
+            continue;
+        }
+        if (kept != i)
+            nodes[kept] = std::move(nodes[i]);
+        kept++;
+    }
+    nodes.erase(nodes.begin() + kept, nodes.end());
+    for (auto& event : fixed)
+        SetLevel(nets, event.net, event.level);
 }
 
-Block::~Block() {
-    if (refCounter == 0) {
-        for (auto &comp : comps) {
-            delete comp;
+// Every node is evaluated in the first tick, nets no node drives are watched for changes made from outside
+void Engine::CompileTimed() {
+    NetState& nets = Connector::nets;
+    wheel.assign(WHEEL_SIZE, {});
+    fanout.clear();
+    sources.clear();
+    sourceLevels.clear();
+    projected.assign(nodes.size(), 0);
+    triggered.clear();
+    isTriggered.assign(nodes.size(), true);
+
+    std::unordered_set<int> driven;
+    for (int i = 0; i < nodes.size(); i++) {
+        Node& node = nodes[i];
+        if (node.macro < 0) {
+            driven.insert(node.out);
+            projected[i] = LevelOf(nets, node.out);
+        } else {
+            for (auto& out : macros[node.macro].outs) {
+                for (int b = 0; b < out.width; b++)
+                    driven.insert(out.net + b);
+            }
         }
-        comps.clear();
-        for (auto &line : connections) {
-            delete line;
+        triggered.push_back(i);
+    }
+    for (int i = 0; i < nodes.size(); i++) {
+        for (auto net : nodes[i].ins) {
+            auto& readers = fanout[net];
+            if (readers.empty() && !driven.count(net)) {
+                sources.push_back(net);
+                sourceLevels.push_back(LevelOf(nets, net));
+            }
+            if (readers.empty() || readers.back() != i)
+                readers.push_back(i);
+        }
+    }
+}
+
+void Engine::Trigger(int net) {
+    auto it = fanout.find(net);
+    if (it == fanout.end())
+        return;
+    for (auto i : it->second) {
+        if (!isTriggered[i]) {
+            isTriggered[i] = true;
+            triggered.push_back(i);
+        }
+    }
+}
+
+// A gate schedules its new output after its delay, a macro changes its outputs right away
+void Engine::Evaluate(int i) {
+    NetState& nets = Connector::nets;
+    Node& node = nodes[i];
+    if (node.macro < 0) {
+        int level = GateLevel(nets, node.type, node.ins);
+        if (level != projected[i]) {
+            projected[i] = level;
+            wheel[(time + node.delay) % WHEEL_SIZE].push_back({ node.out, level });
+        }
+        return;
+    }
+    MacroOp& op = macros[node.macro];
+    // Macros have at most three outputs
+    uint64_t before[6];
+    for (int k = 0; k < op.outs.size(); k++) {
+        before[2 * k] = nets.GetWord(op.outs[k].net, op.outs[k].width);
+        before[2 * k + 1] = nets.GetUnknownWord(op.outs[k].net, op.outs[k].width);
+    }
+    RunMacro(op, nets);
+    for (int k = 0; k < op.outs.size(); k++) {
+        Port& out = op.outs[k];
+        uint64_t changed = (before[2 * k] ^ nets.GetWord(out.net, out.width)) |
+                           (before[2 * k + 1] ^ nets.GetUnknownWord(out.net, out.width));
+        for (int b = 0; b < out.width; b++) {
+            if (changed >> b & 1)
+                Trigger(out.net + b);
+        }
+    }
+}
+
+// Events in a slot of the wheel change nets at that tick, the nodes reading them are evaluated in rounds
+// until nothing more changes within the tick
+void Engine::RunTimed() {
+    NetState& nets = Connector::nets;
+    for (int i = 0; i < sources.size(); i++) {
+        int level = LevelOf(nets, sources[i]);
+        if (level != sourceLevels[i]) {
+            sourceLevels[i] = level;
+            Trigger(sources[i]);
+        }
+    }
+    auto& slot = wheel[time % WHEEL_SIZE];
+    for (int round = 0; round < MAX_ROUNDS && (!slot.empty() || !triggered.empty()); round++) {
+        current.clear();
+        current.swap(slot);
+        for (auto& event : current) {
+            if (LevelOf(nets, event.net) != event.level) {
+                SetLevel(nets, event.net, event.level);
+                Trigger(event.net);
+            }
+        }
+        evaluating.clear();
+        evaluating.swap(triggered);
+        for (auto i : evaluating)
+            isTriggered[i] = false;
+        for (auto i : evaluating)
+            Evaluate(i);
+    }
+    // Changes still left when the rounds run out are moved to the next tick, ahead of the ones due then,
+    // instead of waiting a full turn of the wheel
+    if (!slot.empty()) {
+        auto& next = wheel[(time + 1) % WHEEL_SIZE];
+        next.insert(next.begin(), slot.begin(), slot.end());
+        slot.clear();
+    }
+    time++;
+}
+
+void Engine::Run() {
+    NetState& nets = Connector::nets;
+    // Nets nothing evaluates are set again, in case they were written since
+    for (auto& event : fixed)
+        SetLevel(nets, event.net, event.level);
+    if (timed) {
+        RunTimed();
+        return;
+    }
+    for (auto& group : groups) {
+        if (!group.macros.empty()) {
+            for (auto m : group.macros)
+                RunMacro(macros[m], nets);
+            continue;
+        }
+        switch (group.type) {
+        case Gate::Type::NOT:
+            EvalGroup<Gate::Type::NOT>(nets, group.pins, group.numInputs);
+            break;
+        case Gate::Type::AND:
+            EvalGroup<Gate::Type::AND>(nets, group.pins, group.numInputs);
+            break;
+        case Gate::Type::OR:
+            EvalGroup<Gate::Type::OR>(nets, group.pins, group.numInputs);
+            break;
+        case Gate::Type::XOR:
+            EvalGroup<Gate::Type::XOR>(nets, group.pins, group.numInputs);
+            break;
+        case Gate::Type::BUF:
+            EvalGroup<Gate::Type::BUF>(nets, group.pins, group.numInputs);
+            break;
+        case Gate::Type::NAND:
+            EvalGroup<Gate::Type::NAND>(nets, group.pins, group.numInputs);
+            break;
+        case Gate::Type::NOR:
+            EvalGroup<Gate::Type::NOR>(nets, group.pins, group.numInputs);
+            break;
+        case Gate::Type::XNOR:
+            EvalGroup<Gate::Type::XNOR>(nets, group.pins, group.numInputs);
+            break;
+        case Gate::Type::TRI:
+            EvalGroup<Gate::Type::TRI>(nets, group.pins, group.numInputs);
+            break;
         }
-        connections.clear();
     }
 }
 
@@ -749,7 +2631,7 @@ void MenuPanel::Draw() {
     }
 }
 
-// void MenuPanel::Save(std::ofstream& s) {
+// void MenuPanel::Save(std::ostream& s) {
 //     for (auto& button : buttons)
 //         Write(s, &button);
 // }
@@ -774,7 +2656,7 @@ void MainMenu::Draw() {
     }
 }
 
-// void MainMenu::Save(std::ofstream& s) {
+// void MainMenu::Save(std::ostream& s) {
 //     for (auto& button : buttons)
 //         Write(s, &button);
 // }
@@ -798,8 +2680,10 @@ void Dialog::Draw() {
 
         if (result >= 0) {
             type = Type::NONE;
-            if (result == 1)
+            if (result == 1) {
+                parent->Journal(JournalOp::CREATE_BLOCK, parent->block, Pack(std::string(blockName), color));
                 parent->CreateBlock(blockName, color);
+            }
         }
     } else if (type == Type::NEW) {
         result = GuiTextInputBox({ pos.x, pos.y, width, height }, "Create Project", "Give your project a name","Ok;Cancel", projectName);
@@ -813,6 +2697,7 @@ void Dialog::Draw() {
                 parent->name += projectName;
                 parent->name += ".psf";
                 parent->state = Symulator::State::ACTIVE;
+                parent->WriteSnapshot();
             }
         }
     } else {
@@ -859,6 +2744,7 @@ void Dialog::Show(Type showType) {
 }
 
 Symulator::~Symulator() {
+    FinishSave(true);
     for (auto &menu : compMenu) {
         delete menu;
     }
@@ -872,7 +2758,7 @@ void Symulator::DrawPanel() {
     DrawRectangleLines(0, 0, GetScreenWidth(), GetScreenHeight(), YELLOW);
 
     DrawComponentMenu();
-    DrawTextEx(font, TextFormat("[ %s ]", name.c_str()), { 5, 45 }, 16, 1, YELLOW);
+    DrawTextEx(font, TextFormat("[ %s ]%s", name.c_str(), compress ? " (compressed)" : ""), { 5, 45 }, 16, 1, YELLOW);
     menu.Draw();
 }
 
@@ -880,25 +2766,85 @@ void Symulator::DrawComponents() {
     for (auto &comp : block->comps) {
         comp->Draw();
     }
+    // Edits of a frame that returned early are compiled in the next one, until then the path may be gone
+    if (showCritical && !engine.Stale(block)) {
+        for (auto& step : engine.criticalPath)
+            DrawRectangleLinesEx(step[0]->rect, 2, GOLD);
+    }
+    for (auto &comp : selection) {
+        DrawRectangleLinesEx(comp->rect, 2, YELLOW);
+    }
+    if (state == State::SELECTING) {
+        DrawRectangleLinesEx(SelectionRect(selectStart, GetMousePosition()), 1, YELLOW);
+    }
 }
 
 void Symulator::DrawConnections() {
     int i = 1;
+    bool critical = showCritical && !engine.Stale(block);
     for (auto &con : block->connections) {
         float y1 = con->start->pos.y;
         float y2 = con->end->pos.y;
         float w1 = (con->end->pos.x - con->start->pos.x) * i++ / 10;
-        DrawLineEx({con->start->pos.x, y1}, {con->start->pos.x + w1, y1}, 3.0, RAYWHITE);
-        DrawLineEx({con->start->pos.x + w1, y2}, {con->end->pos.x, y2 }, 3.0, RAYWHITE);
-        DrawLineEx({con->start->pos.x + w1, y1}, {con->start->pos.x + w1, y2}, 3.0, RAYWHITE);
+        // Buses are drawn thicker
+        float thick = con->start->width > 1 ? 5.0 : 3.0;
+        Color color = RAYWHITE;
+        if (critical && OnCriticalPath(con))
+            color = GOLD;
+        else if (critical && InLoop(con))
+            color = RED;
+        DrawLineEx({con->start->pos.x, y1}, {con->start->pos.x + w1, y1}, thick, color);
+        DrawLineEx({con->start->pos.x + w1, y2}, {con->end->pos.x, y2 }, thick, color);
+        DrawLineEx({con->start->pos.x + w1, y1}, {con->start->pos.x + w1, y2}, thick, color);
+    }
+}
+
+// A line is on the critical path when one of its bits is and it joins two components of the board that follow
+// each other on it, steps inside a block count as the block
+bool Symulator::OnCriticalPath(const Line* line) const {
+    auto& path = engine.criticalPath;
+    bool next = false;
+    const Component* last = nullptr;
+    for (size_t i = 0; i < path.size() && !next; i++) {
+        if (path[i][0] == last)
+            continue;
+        next = last == line->start->parent && path[i][0] == line->end->parent;
+        last = path[i][0];
+    }
+    if (!next)
+        return false;
+    for (int b = 0; b < line->start->width; b++) {
+        if (engine.criticalNets.count(line->start->net + b))
+            return true;
+    }
+    return false;
+}
+
+bool Symulator::InLoop(const Line* line) const {
+    for (int b = 0; b < line->start->width; b++) {
+        if (engine.loopNets.count(line->start->net + b))
+            return true;
     }
+    return false;
 }
 
 void Symulator::CreateComponentMenu() {
     float x = 20;
     compMenu.push_back(new Gate(x, 5, "AND", Gate::Type::AND));
     x += Gate::WIDTH + 20;
-    compMenu.push_back(new Gate(x, 5, "NOT", Gate::Type::NOT, true));
+    compMenu.push_back(new Gate(x, 5, "NOT", Gate::Type::NOT, 1));
+    x += Gate::WIDTH + 20;
+    compMenu.push_back(new Gate(x, 5, "OR", Gate::Type::OR));
+    x += Gate::WIDTH + 20;
+    compMenu.push_back(new Gate(x, 5, "XOR", Gate::Type::XOR));
+    x += Gate::WIDTH + 20;
+    compMenu.push_back(new Gate(x, 5, "NAND", Gate::Type::NAND));
+    x += Gate::WIDTH + 20;
+    compMenu.push_back(new Gate(x, 5, "NOR", Gate::Type::NOR));
+    x += Gate::WIDTH + 20;
+    compMenu.push_back(new Gate(x, 5, "XNOR", Gate::Type::XNOR));
+    x += Gate::WIDTH + 20;
+    compMenu.push_back(new Gate(x, 5, "TRI", Gate::Type::TRI));
     x += Gate::WIDTH + 20;
     compMenu.push_back(new Input(x, 5, "I1"));
     x += Input::WIDTH + 20;
@@ -915,16 +2861,45 @@ void Symulator::CreateComponentMenu() {
     compMenu.push_back(new OutputBlock(x, 5, Component::Type::OUTPUT4, "O4"));
     x += Input::WIDTH + 20;
     compMenu.push_back(new OutputBlock(x, 5, Component::Type::OUTPUT8, "O8"));
-
-    compMenuNextX = x + Output::WIDTH + 20;
+    x += Input::WIDTH + 20;
+    compMenu.push_back(new Splitter(x, 5, Component::Type::SPLITTER, "SPL"));
+    x += Splitter::WIDTH + 20;
+    compMenu.push_back(new Splitter(x, 5, Component::Type::MERGER, "MRG"));
+    x += Splitter::WIDTH + 20;
+    compMenu.push_back(new Macro(x, 5, "ADD", Macro::Kind::ADD));
+    x += Macro::WIDTH + 20;
+    compMenu.push_back(new Macro(x, 5, "SUB", Macro::Kind::SUB));
+    x += Macro::WIDTH + 20;
+    compMenu.push_back(new Macro(x, 5, "CMP", Macro::Kind::CMP));
+    x += Macro::WIDTH + 20;
+    compMenu.push_back(new Macro(x, 5, "MUX", Macro::Kind::MUX));
+    x += Macro::WIDTH + 20;
+    compMenu.push_back(new Macro(x, 5, "DEC", Macro::Kind::DEC, 3));
+    x += Macro::WIDTH + 20;
+    compMenu.push_back(new Macro(x, 5, "SHF", Macro::Kind::SHF));
+    x += Macro::WIDTH + 20;
+    compMenu.push_back(new Macro(x, 5, "REG", Macro::Kind::REG));
+    x += Macro::WIDTH + 20;
+    compMenu.push_back(new Memory(x, 5, Component::Type::RAM, "RAM"));
+    x += Memory::WIDTH + 20;
+    compMenu.push_back(new Memory(x, 5, Component::Type::ROM, "ROM"));
+
+    compMenuNextX = x + Memory::WIDTH + 20;
     numStdMenuElems = compMenu.size();
 }
 
 void Symulator::CreateBlock(const char* name, Color color) {
-    compMenu.push_back(new Block(compMenuNextX, 5, name, color, block->comps, block->connections));
+    Block* libBlock = new Block(compMenuNextX, 5, name, color, block->comps, block->connections);
+    // The new block takes over the memory its components live in
+    libBlock->arena = std::move(block->arena);
+    block->arena = std::make_shared<Arena>();
+    compMenu.push_back(libBlock);
     compMenuNextX += Block::WIDTH + 20;
     block->comps.clear();
     block->connections.clear();
+    // Undo steps refer to the board by component indices that no longer hold
+    ClearHistory();
+    selection.clear();
 }
 
 void Symulator::Log(const char* text) {
@@ -966,66 +2941,289 @@ void Symulator::MoveComponentMenu(float delta) {
             return;
         }
     }
-    compMenuNextX += delta;
-    for (auto &comp : compMenu) {
-        comp->Move({delta, 0});
+    compMenuNextX += delta;
+    for (auto &comp : compMenu) {
+        comp->Move({delta, 0});
+    }
+}
+
+void Symulator::DeleteConnection(Connector* conn) {
+    std::list<int> idxToDelete;
+    for (int i = 0; i < block->connections.size(); i++) {
+        if (block->connections[i]->start == conn || block->connections[i]->end == conn) {
+            idxToDelete.push_front(i);
+        }
+    }
+
+    std::vector<Connector*> ends;
+    for (auto i : idxToDelete) {
+        ends.push_back(block->connections[i]->end);
+        block->arena->Delete(block->connections[i]);
+        block->connections.erase(block->connections.begin() + i);
+    }
+    // Inputs left are unconnected or on the net of a driver still there
+    for (auto end : ends)
+        Rewire(*block, end);
+}
+
+void Symulator::DeleteComponent(Component* comp) {
+    if (comp->type == Component::Type::BLOCK) {
+        DeleteBlock(static_cast<Block *>(comp));
+        return;
+    }
+
+    for (auto& in : comp->inConns)
+        DeleteConnection(&in);
+    for (auto& out : comp->outConns)
+        DeleteConnection(&out);
+    block->comps.erase(std::remove(block->comps.begin(), block->comps.end(), comp), block->comps.end());
+    block->arena->Delete(comp);
+}
+
+void Symulator::DeleteBlock(Block* comp) {
+    for (auto &in : comp->inConns)
+        DeleteConnection(&in);
+    for (auto &out : comp->outConns)
+        DeleteConnection(&out);
+    block->comps.erase(std::remove(block->comps.begin(), block->comps.end(), comp), block->comps.end());
+    block->arena->Delete<Component>(comp);
+}
+
+void Symulator::DeleteAll() {
+    for (auto &comp : block->comps) {
+        block->arena->Delete(comp);
+    }
+    block->comps.clear();
+    block->connections.clear();
+    // Lines and the memory of all components go at once, instances still using it keep it alive
+    block->arena = std::make_shared<Arena>();
+    selection.clear();
+}
+
+// Removes the components at the given ascending indices, going over the lines and components once
+void Symulator::DeleteComponents(const std::vector<int>& indices) {
+    std::unordered_set<Component*> removed;
+    for (auto idx : indices)
+        removed.insert(block->comps[idx]);
+
+    auto& lines = block->connections;
+    std::unordered_set<Connector*> ends;
+    lines.erase(std::remove_if(lines.begin(), lines.end(), [&](Line* line) {
+        if (!removed.count(line->start.comp) && !removed.count(line->end.comp))
+            return false;
+        if (!removed.count(line->end.comp))
+            ends.insert(line->end);
+        block->arena->Delete(line);
+        return true;
+    }), lines.end());
+    for (auto end : ends)
+        Rewire(*block, end);
+
+    auto& comps = block->comps;
+    comps.erase(std::remove_if(comps.begin(), comps.end(), [&](Component* comp) {
+        return removed.count(comp) != 0;
+    }), comps.end());
+    for (auto comp : removed)
+        block->arena->Delete(comp);
+}
+
+void Symulator::SetGateInputs(Gate* gate, int count) {
+    for (int i = count; i < gate->inConns.size(); i++)
+        DeleteConnection(&gate->inConns[i]);
+    gate->SetInputs(count);
+}
+
+void Symulator::SetBus(Component* comp, bool bus) {
+    for (auto& in : comp->inConns)
+        DeleteConnection(&in);
+    for (auto& out : comp->outConns)
+        DeleteConnection(&out);
+    if (comp->type == Component::Type::INPUT2 || comp->type == Component::Type::INPUT4 ||
+        comp->type == Component::Type::INPUT8)
+        static_cast<InputBlock*>(comp)->SetBus(bus);
+    else
+        static_cast<OutputBlock*>(comp)->SetBus(bus);
+}
+
+void Symulator::SetBusWidth(Splitter* splitter, int width) {
+    DeleteConnection(&splitter->Bus());
+    auto& bits = splitter->Bits();
+    for (int i = width; i < bits.size(); i++)
+        DeleteConnection(&bits[i]);
+    splitter->SetWidth(width);
+}
+
+// Connectors that ResizePorts replaces
+std::vector<Connector*> ResizedPorts(Component* comp, const std::vector<int>& ins, const std::vector<int>& outs) {
+    std::vector<Connector*> ports;
+    for (int i = 0; i < comp->inConns.size(); i++) {
+        if (i >= ins.size() || comp->inConns[i].width != ins[i])
+            ports.push_back(&comp->inConns[i]);
+    }
+    for (int i = 0; i < comp->outConns.size(); i++) {
+        if (i >= outs.size() || comp->outConns[i].width != outs[i])
+            ports.push_back(&comp->outConns[i]);
     }
+    return ports;
 }
 
-void Symulator::DeleteConnection(Connector* conn) {
-    std::vector<Connector *> nextList;
-    std::list<int> idxToDelete;
-    for (int i = 0; i < block->connections.size(); i++) {
-        if (block->connections[i]->start == conn || block->connections[i]->end == conn) {
-            if (conn->type == Connector::Type::OUT && nextList.size() == 0) {
-                nextList = GetNextConnector(block->connections, conn);
-            }
+std::vector<Connector*> ResizedPorts(Macro* macro, int width) {
+    std::vector<int> ins, outs;
+    Macro::PortWidths(macro->kind, width, ins, outs);
+    return ResizedPorts(macro, ins, outs);
+}
 
-            idxToDelete.push_front(i);
-        }
-    }
+std::vector<Connector*> ResizedPorts(Memory* memory, int addrWidth, int dataWidth) {
+    std::vector<int> ins, outs;
+    Memory::PortWidths(memory->type, addrWidth, dataWidth, ins, outs);
+    return ResizedPorts(memory, ins, outs);
+}
 
-    for (auto i : idxToDelete) {
-        delete block->connections[i];
-        block->connections.erase(block->connections.begin() + i);
+void Symulator::SetMacroWidth(Macro* macro, int width) {
+    width = std::max(1, std::min(width, Macro::MaxWidth(macro->kind)));
+    for (auto port : ResizedPorts(macro, width))
+        DeleteConnection(port);
+    macro->SetWidth(width);
+}
+
+// Unconnected inputs read as Z and registers as X until they are clocked
+void Symulator::SetFourState(bool on) {
+    Connector::nets.SetFourState(on);
+    engine.unknownRegisters = on;
+    engine.dirty = true;
+}
+
+// Simulated time starts over whenever timed simulation is turned on
+void Symulator::SetTimed(bool on) {
+    engine.timed = on;
+    engine.time = 0;
+    engine.dirty = true;
+}
+
+void Symulator::SetMemory(Memory* memory, int addrWidth, int dataWidth, const std::string& contents) {
+    addrWidth = std::max(1, std::min(addrWidth, Memory::MAX_ADDRESS));
+    dataWidth = std::max(1, std::min(dataWidth, 64));
+    for (auto port : ResizedPorts(memory, addrWidth, dataWidth))
+        DeleteConnection(port);
+    memory->contents = contents;
+    memory->SetWidths(addrWidth, dataWidth);
+    engine.ForgetMemory(memory);
+}
+
+// Contents past the new size are dropped, the tail is what an earlier change cut off and goes back after the
+// contents as they are now
+void Symulator::SetMemoryWidths(Memory* memory, int addrWidth, int dataWidth, const std::string& tail) {
+    addrWidth = std::max(1, std::min(addrWidth, Memory::MAX_ADDRESS));
+    dataWidth = std::max(1, std::min(dataWidth, 64));
+    for (auto port : ResizedPorts(memory, addrWidth, dataWidth))
+        DeleteConnection(port);
+    if (!tail.empty()) {
+        memory->contents.resize(memory->MaxBytes());
+        memory->contents += tail;
     }
+    memory->SetWidths(addrWidth, dataWidth);
+    engine.ForgetMemory(memory);
+}
 
-    for (auto next : nextList) {
-        next->value = false;
-        UpdateConnections(block->connections, next);
+std::vector<int> Symulator::SelectionIndices() {
+    std::unordered_set<Component*> selected(selection.begin(), selection.end());
+    std::vector<int> indices;
+    for (int i = 0; i < block->comps.size(); i++) {
+        if (selected.count(block->comps[i]))
+            indices.push_back(i);
     }
+    return indices;
 }
 
-void Symulator::DeleteComponent(Component* comp) {
-    if (comp->type == Component::Type::BLOCK) {
-        DeleteBlock(static_cast<Block *>(comp));
+void Symulator::DeleteSelection() {
+    std::vector<int> indices = SelectionIndices();
+    if (indices.empty())
         return;
+
+    std::vector<Edit> undo;
+    for (auto idx : indices)
+        undo.push_back(SaveComponent(block->comps, idx));
+    std::unordered_set<Component*> selected(selection.begin(), selection.end());
+    ConnectorIndex index = IndexConnectors(block->comps);
+    for (auto& line : block->connections) {
+        if (selected.count(line->start.comp) || selected.count(line->end.comp))
+            undo.push_back({ JournalOp::ADD_CONNECTION,
+                             Pack(GetComponentIdx(index, line->start), GetComponentIdx(index, line->end)) });
     }
 
-    for (auto& in : comp->inConns)
-        DeleteConnection(&in);
-    for (auto& out : comp->outConns)
-        DeleteConnection(&out);
-    block->comps.erase(std::remove(block->comps.begin(), block->comps.end(), comp), block->comps.end());
+    Record(JournalOp::DELETE_COMPONENTS, PackIndices(indices), std::move(undo));
+    DeleteComponents(indices);
+    selection.clear();
 }
 
-void Symulator::DeleteBlock(Block* comp) {
-    for (auto &in : comp->inConns)
-        DeleteConnection(&in);
-    for (auto &out : comp->outConns)
-        DeleteConnection(&out);
-    block->comps.erase(std::remove(block->comps.begin(), block->comps.end(), comp), block->comps.end());
+void Symulator::CopySelection() {
+    std::vector<int> indices = SelectionIndices();
+    if (indices.empty())
+        return;
+
+    clipboard.clear();
+    clipboardLines.clear();
+    std::unordered_map<Component*, int> copied;
+    for (auto idx : indices) {
+        Component* comp = block->comps[idx];
+        copied.emplace(comp, (int)clipboard.size());
+        std::ostringstream data(std::ios_base::binary);
+        comp->Save(data);
+        clipboard.push_back(data.str());
+    }
+    // Only lines between copied components come along
+    for (auto& line : block->connections) {
+        auto start = copied.find(line->start.comp);
+        auto end = copied.find(line->end.comp);
+        if (start != copied.end() && end != copied.end())
+            clipboardLines.push_back({ { start->second, Connector::Type::OUT, line->start.idx },
+                                       { end->second, Connector::Type::IN, line->end.idx } });
+    }
 }
 
-void Symulator::DeleteAll() {
-    for (auto &line : block->connections) {
-        delete line;
+// Pasted components become the selection, so they can be moved into place right away
+void Symulator::Paste() {
+    if (clipboard.empty())
+        return;
+
+    int first = block->comps.size();
+    std::vector<Edit> redo;
+    std::vector<int> indices;
+    selection.clear();
+    for (auto& data : clipboard) {
+        Reader s(data.data(), data.size());
+        s.version = PROJECT_VERSION;
+        Component* comp = ReadComponent(s, *block->arena);
+        if (!comp)
+            continue;
+        comp->Move({ PASTE_OFFSET, PASTE_OFFSET });
+        comp->prevPos = { comp->rect.x, comp->rect.y };
+        indices.push_back(block->comps.size());
+        block->comps.push_back(comp);
+        selection.push_back(comp);
+
+        std::ostringstream moved(std::ios_base::binary);
+        comp->Save(moved);
+        redo.push_back({ JournalOp::ADD_COMPONENT, moved.str() });
     }
-    block->connections.clear();
-    for (auto &comp : block->comps) {
-        delete comp;
+    if (indices.size() != clipboard.size()) {
+        DeleteComponents(indices);
+        selection.clear();
+        return;
     }
-    block->comps.clear();
+
+    for (auto& line : clipboardLines) {
+        CompIdx start = line.first;
+        CompIdx end = line.second;
+        start.compIdx += first;
+        end.compIdx += first;
+        std::string data = Pack(start, end);
+        Reader s(data.data(), data.size());
+        ApplyJournal(JournalOp::ADD_CONNECTION, block, s);
+        redo.push_back({ JournalOp::ADD_CONNECTION, data });
+    }
+
+    Record(std::move(redo), { { JournalOp::DELETE_COMPONENTS, PackIndices(indices) } });
 }
 
 Component* Symulator::CheckComponentMenu(const Vector2& pos) {
@@ -1141,91 +3339,840 @@ bool Symulator::ComponentCollide(Component* comp) {
     return false;
 }
 
-void Symulator::ReadProjectData(std::ifstream& s) {
-    Read(s, &compMenuNextX);
+void Symulator::ReadProjectData(Reader& s) {
+    if (s.version >= 3)
+        Read(s, &journalSeq);
+    // Library blocks are laid out again after the standard items, there may be more of those than when it was saved
+    float savedNextX;
+    Read(s, &savedNextX);
+    size_t first = compMenu.size();
     size_t size;
-    Read(s, &size);
+    ReadCount(s, &size);
     for (size_t i = 0; i < size; i++) {
+        if (s.version < 4) {
+            Component::Type type;
+            Read(s, &type);
+            if (type == Component::Type::BLOCK) {
+                compMenu.push_back(new Block(s, type));
+            }
+            continue;
+        }
+
+        LibraryEntry kind = LibraryEntry::EMBEDDED;
+        if (s.version >= 5)
+            Read(s, &kind);
+
+        Color color;
+        Read(s, &color);
+        if (kind == LibraryEntry::REFERENCE) {
+            // A block whose library file is gone stays in the menu, but empty
+            Component::Type type;
+            uint64_t hash;
+            Read(s, &type);
+            Block* libBlock = new Block(s, type, color);
+            Read(s, &hash);
+            if (LibraryBlock* lib = s.fail ? nullptr : FindLibraryBlock(hash)) {
+                Reader contents(lib->data->data() + lib->offset, lib->size);
+                contents.version = lib->version;
+                contents.owner = lib->data;
+                libBlock->Defer(contents);
+                libBlock->hash = hash;
+            } else if (!s.fail) {
+                Log(TextFormat("Cannot find the library file of %s", libBlock->text.c_str()));
+            }
+            compMenu.push_back(libBlock);
+            continue;
+        }
+
+        size_t blockSize;
+        ReadCount(s, &blockSize);
+        Reader entry(s.data + s.pos, blockSize);
+        entry.version = s.version;
+        entry.owner = s.owner;
+        s.pos += blockSize;
+
         Component::Type type;
-        Read(s, &type);
+        Read(entry, &type);
         if (type == Component::Type::BLOCK) {
-            compMenu.push_back(new Block(s, type));
+            Block* libBlock = new Block(entry, type, color);
+            libBlock->Defer(entry);
+            compMenu.push_back(libBlock);
         }
+        s.fail |= entry.fail;
+    }
+    for (size_t i = first; i < compMenu.size(); i++) {
+        compMenu[i]->Move({ compMenuNextX - compMenu[i]->rect.x, 0 });
+        compMenuNextX += Block::WIDTH + 20;
     }
 
-    ReadComponents(s, block->comps);
+    ReadComponents(s, mainBlock.comps, *mainBlock.arena);
 
-    Read(s, &size);
+    ReadCount(s, &size);
 
-    block->connections.reserve(size);
+    mainBlock.connections.reserve(size);
     for (int i = 0; i < size; i++) {
-        Connector *start = Read(s, block->connections, block->comps);
-        Connector *end = Read(s, block->connections, block->comps);
+        Connector *start = Read(s, mainBlock.connections, mainBlock.comps);
+        Connector *end = Read(s, mainBlock.connections, mainBlock.comps);
 
-        block->connections.push_back(new Line(start, end));
+        if (start && end && start->width == end->width)
+            mainBlock.connections.push_back(mainBlock.arena->New<Line>(start, end));
+    }
+    RewireAll(mainBlock);
+
+    if (s.version >= 8) {
+        ReadCount(s, &size);
+        engine.savedBoard = &mainBlock;
+        for (size_t i = 0; i < size && !s.fail; i++) {
+            size_t depth;
+            ReadCount(s, &depth);
+            std::vector<int> indices(depth);
+            for (auto& index : indices)
+                Read(s, &index);
+            std::string contents;
+            Read(s, &contents);
+            engine.savedMemories[indices] = std::move(contents);
+        }
     }
 }
 
-void Symulator::WriteProjectData(std::ofstream& s) {
+// Fails when a library file could not be written, the project would refer to it
+bool Symulator::WriteProjectData(std::ostream& s) {
+    Write(s, &journalSeq);
     Write(s, &compMenuNextX);
     size_t size = compMenu.size() - numStdMenuElems /* AND, NOT ... */;
     Write(s, &size);
+    bool ok = true;
     for (size_t i = 0; i < size; i++)
-        compMenu[numStdMenuElems + i]->Save(s);
+        ok &= SaveLibraryBlock(static_cast<Block*>(compMenu[numStdMenuElems + i]), s);
 
-    size = block->comps.size();
+    size = mainBlock.comps.size();
     Write(s, &size);
 
-    for (auto& comp : block->comps)
+    for (auto& comp : mainBlock.comps)
         comp->Save(s);
 
-    size = block->connections.size();
+    ConnectorIndex index = IndexConnectors(mainBlock.comps);
+
+    size = mainBlock.connections.size();
+    Write(s, &size);
+
+    for (auto& connection : mainBlock.connections) {
+        Write(s, connection->start, index);
+        Write(s, connection->end, index);
+    }
+
+    // RAM of block instances, also what was loaded and not compiled since
+    std::map<std::vector<int>, std::string*> memories;
+    for (auto& saved : engine.savedMemories)
+        memories[saved.first] = &saved.second;
+    for (auto& memory : engine.instanceMemories) {
+        if (memory.first[0] == &mainBlock)
+            memories[memory.second.indices] = &memory.second.contents;
+    }
+    size = memories.size();
+    Write(s, &size);
+    for (auto& memory : memories) {
+        size_t depth = memory.first.size();
+        Write(s, &depth);
+        for (auto index : memory.first)
+            Write(s, &index);
+        Write(s, memory.second);
+    }
+    return ok;
+}
+
+// Compressed files hold the project data as a series of independently deflated chunks.
+// Fails when a chunk could not be compressed.
+bool WriteProjectFile(std::ostream& s, const std::string& data, bool compressed) {
+    int version = PROJECT_VERSION;
+    if (!compressed) {
+        s.write(PROJECT_MAGIC, sizeof(PROJECT_MAGIC));
+        Write(s, &version);
+        s.write(data.data(), data.size());
+        return true;
+    }
+
+    s.write(COMPRESSED_MAGIC, sizeof(COMPRESSED_MAGIC));
+    Write(s, &version);
+    uint64_t size = data.size();
     Write(s, &size);
+    for (size_t offset = 0; offset < data.size(); offset += CHUNK_SIZE) {
+        int rawSize = (int)std::min<size_t>(CHUNK_SIZE, data.size() - offset);
+        int compSize = 0;
+        unsigned char* comp = CompressData((unsigned char*)data.data() + offset, rawSize, &compSize);
+        if (!comp)
+            return false;
+        Write(s, &rawSize);
+        Write(s, &compSize);
+        s.write((const char*)comp, compSize);
+        MemFree(comp);
+    }
+    int end = 0;
+    Write(s, &end);
+    return true;
+}
+
+// FNV-1a, identifies block contents in library files
+uint64_t Hash(const char* data, size_t size) {
+    uint64_t hash = 14695981039346656037ull;
+    for (size_t i = 0; i < size; i++) {
+        hash ^= (unsigned char)data[i];
+        hash *= 1099511628211ull;
+    }
+    return hash;
+}
+
+// Blocks are stored one per file named after their hash in one directory, so every project shares them
+std::string LibraryPath(const std::string& dir, uint64_t hash) {
+    char file[32];
+    snprintf(file, sizeof(file), "%016llx.psl", (unsigned long long)hash);
+    return dir + "/" + file;
+}
+
+// Puts a finished file in place of the old one in one step, so a crash leaves one or the other
+bool ReplaceWith(const std::string& from, const std::string& to) {
+#ifdef _WIN32
+    const unsigned long MOVEFILE_REPLACE_EXISTING = 1;
+    return MoveFileExA(from.c_str(), to.c_str(), MOVEFILE_REPLACE_EXISTING) != 0;
+#else
+    return std::rename(from.c_str(), to.c_str()) == 0;
+#endif
+}
+
+bool MakeDirectory(const std::string& path) {
+#ifdef _WIN32
+    return CreateDirectoryA(path.c_str(), nullptr) != 0;
+#else
+    return mkdir(path.c_str(), 0755) == 0;
+#endif
+}
+
+// Written next to the old file and swapped in, so a crash never leaves a half written project
+bool SaveProjectFile(const std::string& name, const std::string& data, bool compressed) {
+    std::string tmpName = name + ".tmp";
+    std::ofstream saveFile(tmpName, std::ios_base::binary);
+    if (!saveFile.is_open())
+        return false;
+    bool written = WriteProjectFile(saveFile, data, compressed);
+    saveFile.close();
+    if (!written || saveFile.fail()) {
+        std::remove(tmpName.c_str());
+        return false;
+    }
+
+    return ReplaceWith(tmpName, name);
+}
+
+bool ReadProjectFile(const std::string& name, ProjectFile& file) {
+    std::ifstream loadFile(name, std::ios_base::binary | std::ios_base::ate);
+    if (!loadFile.is_open())
+        return false;
+    size_t fileSize = (size_t)loadFile.tellg();
+    loadFile.seekg(0);
+
+    char magic[4] = {};
+    loadFile.read(magic, sizeof(magic));
+    if (memcmp(magic, COMPRESSED_MAGIC, sizeof(magic))) {
+        // One read for the whole file, the rest is parsed from memory
+        std::vector<char> data(fileSize);
+        loadFile.seekg(0);
+        loadFile.read(data.data(), data.size());
+        if (!memcmp(magic, PROJECT_MAGIC, sizeof(magic))) {
+            Reader s(data.data(), data.size());
+            s.pos = sizeof(magic);
+            Read(s, &file.version);
+            file.offset = s.pos;
+            file.data = std::move(data);
+            return !s.fail;
+        }
+        file.data = std::move(data);
+        return true;
+    }
+
+    // Chunks are read and inflated one after another straight into the final buffer, only one compressed
+    // chunk is held at a time
+    file.compressed = true;
+    uint64_t size = 0;
+    loadFile.read((char*)&file.version, sizeof(file.version));
+    loadFile.read((char*)&size, sizeof(size));
+    // Deflate can't shrink data more than about 1032 times
+    if (!loadFile || size > (uint64_t)fileSize * 1032)
+        return false;
+    file.data.resize(size);
+
+    std::vector<char> chunk;
+    size_t offset = 0;
+    while (true) {
+        int rawSize = 0, compSize = 0;
+        loadFile.read((char*)&rawSize, sizeof(rawSize));
+        if (rawSize == 0 || !loadFile)
+            break;
+        loadFile.read((char*)&compSize, sizeof(compSize));
+        if (!loadFile || rawSize < 0 || compSize < 0 || rawSize > size - offset || compSize > fileSize)
+            return false;
+        chunk.resize(compSize);
+        loadFile.read(chunk.data(), compSize);
+        if (!loadFile)
+            return false;
+
+        int length = 0;
+        unsigned char* raw = DecompressData((unsigned char*)chunk.data(), compSize, &length);
+        if (!raw || length != rawSize) {
+            MemFree(raw);
+            return false;
+        }
+        memcpy(file.data.data() + offset, raw, length);
+        offset += length;
+        MemFree(raw);
+    }
+    return !!loadFile && offset == size;
+}
+
+// Library files hold any number of blocks, all of them are cached when one is looked up
+LibraryBlock* Symulator::FindLibraryBlock(uint64_t hash) {
+    auto it = libraries.find(hash);
+    if (it != libraries.end())
+        return &it->second;
+
+    // Projects of version 7 and older kept their library next to them, the block moves on the next save
+    ProjectFile file;
+    if (!ReadProjectFile(LibraryPath(libraryDir, hash), file) &&
+        !ReadProjectFile(LibraryPath(std::string(GetDirectoryPath(name.c_str())) + "/lib", hash), file))
+        return nullptr;
+    if (file.data.size() < sizeof(LIBRARY_MAGIC) || memcmp(file.data.data(), LIBRARY_MAGIC, sizeof(LIBRARY_MAGIC)))
+        return nullptr;
+
+    auto data = std::make_shared<const std::vector<char>>(std::move(file.data));
+    Reader s(data->data(), data->size());
+    s.pos = sizeof(LIBRARY_MAGIC);
+    int version;
+    size_t size;
+    Read(s, &version);
+    ReadCount(s, &size);
+    for (size_t i = 0; i < size && !s.fail; i++) {
+        uint64_t blockHash;
+        size_t blockSize;
+        Read(s, &blockHash);
+        ReadCount(s, &blockSize);
+        if (Hash(s.data + s.pos, blockSize) == blockHash)
+            libraries.emplace(blockHash, LibraryBlock{ data, s.pos, blockSize, version });
+        s.pos += blockSize;
+    }
+
+    it = libraries.find(hash);
+    return it != libraries.end() ? &it->second : nullptr;
+}
+
+// Writes the reference to a library block, storing its contents in a library file when there is none yet.
+// A block keeps its entry until it is edited, even one of an older version. A new entry leaves out the values
+// on its connectors, so simulating the block does not make another one.
+bool Symulator::SaveLibraryBlock(Block* libBlock, std::ostream& s) {
+    uint64_t hash = libBlock->hash;
+    if (!hash) {
+        libBlock->Load();
+        std::ostringstream contents(std::ios_base::binary);
+        Connector::saveValues = false;
+        libBlock->SaveContents(contents);
+        Connector::saveValues = true;
+        std::string bytes = contents.str();
+        auto data = std::make_shared<const std::vector<char>>(bytes.begin(), bytes.end());
+        hash = Hash(data->data(), data->size());
+        libraries.emplace(hash, LibraryBlock{ data, 0, data->size(), PROJECT_VERSION });
+        libBlock->hash = hash;
+    }
 
-    for (auto& connection : block->connections) {
-        Write(s, connection->start, block->connections, block->comps);
-        Write(s, connection->end, block->connections, block->comps);
+    std::string path = LibraryPath(libraryDir, hash);
+    LibraryBlock& lib = libraries[hash];
+    bool ok = true;
+    if (!FileExists(path.c_str())) {
+        if (!DirectoryExists(libraryDir.c_str()))
+            MakeDirectory(libraryDir);
+
+        // Written like a project, a file cut short would never be written again
+        std::string tmpPath = path + ".tmp";
+        std::ofstream libFile(tmpPath, std::ios_base::binary);
+        size_t size = 1;
+        libFile.write(LIBRARY_MAGIC, sizeof(LIBRARY_MAGIC));
+        Write(libFile, &lib.version);
+        Write(libFile, &size);
+        Write(libFile, &hash);
+        Write(libFile, &lib.size);
+        libFile.write(lib.data->data() + lib.offset, lib.size);
+        libFile.close();
+        ok = !libFile.fail() && ReplaceWith(tmpPath, path);
+        if (!ok)
+            std::remove(tmpPath.c_str());
     }
+
+    LibraryEntry kind = LibraryEntry::REFERENCE;
+    Write(s, &kind);
+    Write(s, &libBlock->color);
+    libBlock->Component::Save(s);
+    Write(s, &hash);
+    return ok;
 }
 
 void Symulator::LoadProject() {
+    FinishSave(true);
     ClearProject();
-    std::ifstream loadFile(name, std::ios_base::binary);
-    if (loadFile.is_open()) {
-        ReadProjectData(loadFile);
-
-        loadFile.close();
+    journal.close();
+    journalSeq = 0;
+    ProjectFile file;
+    if (ReadProjectFile(name, file)) {
+        auto data = std::make_shared<std::vector<char>>(std::move(file.data));
+        Reader reader(data->data() + file.offset, data->size() - file.offset);
+        reader.version = file.version;
+        reader.owner = data;
+        ReadProjectData(reader);
+        if (reader.fail)
+            ClearProject();
+
+        compress = file.compressed;
         state = State::ACTIVE;
+
+        // Edits recovered from the journal are folded into a fresh snapshot
+        journalRecords = 0;
+        if (!reader.fail && ReplayJournal())
+            WriteSnapshot();
+        else
+            OpenJournal(false);
     }
 }
 
+// Every edit is already in the journal, so saving only rewrites the project once the journal grows long
 void Symulator::SaveProject() {
-    MoveComponentMenu(-menuDelta);
+    if (journal.is_open() && journalRecords < COMPACT_RECORDS) {
+        journal.flush();
+        return;
+    }
+    WriteSnapshot();
+}
+
+// The project is serialized right away, compressing and writing it out happens on saveThread
+void Symulator::WriteSnapshot() {
+    FinishSave(true);
 
     if (!DirectoryExists("projects"))
-        system("mkdir projects");
-    std::ofstream saveFile(name, std::ios_base::binary);
-    if (saveFile.is_open()) {
-        WriteProjectData(saveFile);
+        MakeDirectory("projects");
+
+    // Library blocks are stored at their positions in the unscrolled menu
+    float offset = compMenu.empty() ? 0 : compMenu[0]->rect.x - 20;
+    for (auto& comp : compMenu)
+        comp->Move({-offset, 0});
+    compMenuNextX -= offset;
+
+    std::ostringstream data(std::ios_base::binary);
+    bool ok = WriteProjectData(data);
+
+    for (auto& comp : compMenu)
+        comp->Move({offset, 0});
+    compMenuNextX += offset;
+    // The old snapshot and the journal are kept, the next save tries again
+    lastSave = GetTime();
+    if (!ok)
+        return;
+
+    saveDone = false;
+    saveThread = std::thread([this](std::string name, std::string data, bool compress) {
+        saveOk = SaveProjectFile(name, data, compress);
+        saveDone = true;
+    }, name, data.str(), compress);
+}
+
+// Once the snapshot is on disk the journal only has to keep what was recorded after it
+void Symulator::FinishSave(bool wait) {
+    if (!saveThread.joinable() || (!wait && !saveDone))
+        return;
+    saveThread.join();
 
-        saveFile.close();
+    if ((saveOk || !journal.is_open()) && OpenJournal(true, journalTail))
+        journalRecords = tailRecords;
+    journalTail.clear();
+    tailRecords = 0;
+}
+
+// A journal that could not be replaced is left as it is and not appended to, its records may be older than
+// the snapshot. Edits then go unjournaled until the next save tries again.
+bool Symulator::OpenJournal(bool truncate, const std::string& records) {
+    std::string path = name + ".jrn";
+    journal.close();
+    if (truncate || !FileExists(path.c_str())) {
+        std::string tmpPath = path + ".tmp";
+        std::ofstream tmp(tmpPath, std::ios_base::binary);
+        int version = PROJECT_VERSION;
+        tmp.write(JOURNAL_MAGIC, sizeof(JOURNAL_MAGIC));
+        Write(tmp, &version);
+        tmp.write(records.data(), records.size());
+        tmp.close();
+
+        if (tmp.fail() || !ReplaceWith(tmpPath, path)) {
+            std::remove(tmpPath.c_str());
+            Log(TextFormat("Cannot write %s", path.c_str()));
+            return false;
+        }
+    }
+    journal.open(path, std::ios_base::binary | std::ios_base::app);
+    return journal.is_open();
+}
+
+// Record layout: sequence number, operation, target block (-1 is the board), payload size, payload
+void Symulator::Journal(JournalOp op, Block* target, const std::string& data) {
+    // Every edit passes here, the ones changing what is wired to what need the board compiled again
+    if (op != JournalOp::MOVE_COMPONENT && op != JournalOp::SET_VALUE && op != JournalOp::SET_WORD &&
+        op != JournalOp::SET_SIGNED)
+        engine.dirty = true;
+    // An edited library block needs an entry of its own
+    if (target != &mainBlock)
+        target->hash = 0;
+    if (!journal.is_open() && !saveThread.joinable())
+        return;
+
+    // Library blocks by their place after the standard menu items, which grow as components are added
+    int blockIdx = -1;
+    if (target != &mainBlock)
+        blockIdx = std::find(compMenu.begin() + numStdMenuElems, compMenu.end(), target) - compMenu.begin() - numStdMenuElems;
+    size_t size = data.size();
+
+    journalSeq++;
+    std::ostringstream record(std::ios_base::binary);
+    Write(record, &journalSeq);
+    Write(record, &op);
+    Write(record, &blockIdx);
+    Write(record, &size);
+    record.write(data.data(), data.size());
+
+    std::string bytes = record.str();
+    if (journal.is_open()) {
+        journal.write(bytes.data(), bytes.size());
+        journal.flush();
+    }
+    journalRecords++;
+    if (saveThread.joinable()) {
+        journalTail += bytes;
+        tailRecords++;
+    }
+}
+
+// Returns true when there was anything to recover, a record cut short by a crash ends the replay
+bool Symulator::ReplayJournal() {
+    ProjectFile file;
+    if (!ReadProjectFile(name + ".jrn", file) || file.data.size() < sizeof(JOURNAL_MAGIC) ||
+        memcmp(file.data.data(), JOURNAL_MAGIC, sizeof(JOURNAL_MAGIC)))
+        return false;
+
+    Reader s(file.data.data(), file.data.size());
+    s.pos = sizeof(JOURNAL_MAGIC);
+    int version;
+    Read(s, &version);
+
+    bool replayed = false;
+    while (!s.fail && s.pos < s.size) {
+        uint64_t seq;
+        JournalOp op;
+        int blockIdx;
+        size_t size;
+        Read(s, &seq);
+        Read(s, &op);
+        Read(s, &blockIdx);
+        ReadCount(s, &size);
+        if (s.fail)
+            return true;
+
+        Reader record(s.data + s.pos, size);
+        record.version = version;
+        s.pos += size;
+        if (seq <= journalSeq)
+            continue;
+
+        Block* target = &mainBlock;
+        if (blockIdx >= 0) {
+            if (blockIdx >= (int)compMenu.size() - numStdMenuElems)
+                return true;
+            target = static_cast<Block*>(compMenu[numStdMenuElems + blockIdx]);
+        }
+        if (target != &mainBlock)
+            target->hash = 0;
+        ApplyJournal(op, target, record);
+        journalSeq = seq;
+        replayed = true;
+    }
+    return replayed || s.fail;
+}
+
+void Symulator::ApplyJournal(JournalOp op, Block* target, Reader& s) {
+    Block* current = block;
+    block = target;
+    block->Load();
+
+    switch (op) {
+    case JournalOp::ADD_COMPONENT: {
+        Component* comp = ReadComponent(s, *block->arena);
+        if (comp)
+            block->comps.push_back(comp);
+        break;
+    }
+    case JournalOp::DELETE_COMPONENT: {
+        int idx;
+        Read(s, &idx);
+        if (!s.fail && idx >= 0 && idx < block->comps.size())
+            DeleteComponent(block->comps[idx]);
+        break;
+    }
+    case JournalOp::MOVE_COMPONENT: {
+        int idx;
+        Vector2 pos;
+        Read(s, &idx);
+        Read(s, &pos);
+        if (!s.fail && idx >= 0 && idx < block->comps.size()) {
+            Component* comp = block->comps[idx];
+            comp->Move({ pos.x - comp->rect.x, pos.y - comp->rect.y });
+            comp->prevPos = pos;
+        }
+        break;
+    }
+    case JournalOp::ADD_CONNECTION: {
+        Connector* start = Read(s, block->connections, block->comps);
+        Connector* end = Read(s, block->connections, block->comps);
+        if (start && end)
+            AddConnection(*block, start, end);
+        break;
+    }
+    case JournalOp::DELETE_CONNECTION: {
+        Connector* conn = Read(s, block->connections, block->comps);
+        if (conn)
+            DeleteConnection(conn);
+        break;
+    }
+    case JournalOp::DELETE_ALL:
+        DeleteAll();
+        break;
+    case JournalOp::SET_VALUE: {
+        Connector* conn = Read(s, block->connections, block->comps);
+        bool value;
+        Read(s, &value);
+        if (conn && !s.fail)
+            conn->SetValue(value);
+        break;
+    }
+    case JournalOp::SET_SIGNED: {
+        int idx;
+        bool isSigned;
+        Read(s, &idx);
+        Read(s, &isSigned);
+        if (s.fail || idx < 0 || idx >= block->comps.size())
+            break;
+        Component* comp = block->comps[idx];
+        if (IsInputComponent(comp) && comp->type != Component::Type::INPUT1)
+            static_cast<InputBlock*>(comp)->isSigned = isSigned;
+        else if (IsOutputComponent(comp) && comp->type != Component::Type::OUTPUT1)
+            static_cast<OutputBlock*>(comp)->isSigned = isSigned;
+        break;
+    }
+    case JournalOp::CREATE_BLOCK: {
+        std::string name;
+        Color color;
+        Read(s, &name);
+        Read(s, &color);
+        if (!s.fail)
+            CreateBlock(name.c_str(), color);
+        break;
+    }
+    case JournalOp::INSERT_COMPONENT: {
+        int idx;
+        Read(s, &idx);
+        Component* comp = ReadComponent(s, *block->arena);
+        if (comp) {
+            if (idx < 0 || idx > block->comps.size())
+                idx = block->comps.size();
+            block->comps.insert(block->comps.begin() + idx, comp);
+        }
+        break;
+    }
+    case JournalOp::DELETE_COMPONENTS: {
+        size_t size;
+        ReadCount(s, &size);
+        std::vector<int> indices(size);
+        for (auto& idx : indices)
+            Read(s, &idx);
+        for (int i = 0; i < indices.size(); i++) {
+            if (indices[i] < 0 || indices[i] >= block->comps.size() || (i > 0 && indices[i] <= indices[i - 1]))
+                s.fail = true;
+        }
+        if (!s.fail)
+            DeleteComponents(indices);
+        break;
+    }
+    case JournalOp::SET_INPUTS: {
+        int idx;
+        int count;
+        Read(s, &idx);
+        Read(s, &count);
+        if (s.fail || idx < 0 || idx >= block->comps.size() || block->comps[idx]->type != Component::Type::GATE)
+            break;
+        Gate* gate = static_cast<Gate*>(block->comps[idx]);
+        if (!gate->FixedInputs())
+            SetGateInputs(gate, count);
+        break;
+    }
+    case JournalOp::SET_BUS: {
+        int idx;
+        bool bus;
+        Read(s, &idx);
+        Read(s, &bus);
+        if (!s.fail && idx >= 0 && idx < block->comps.size() && IsBusBlock(block->comps[idx]))
+            SetBus(block->comps[idx], bus);
+        break;
+    }
+    case JournalOp::SET_WORD: {
+        Connector* conn = Read(s, block->connections, block->comps);
+        uint64_t value;
+        Read(s, &value);
+        if (conn && !s.fail)
+            conn->SetWord(value);
+        break;
+    }
+    case JournalOp::SET_WIDTH: {
+        // A memory's record has the address width, the data width and the contents cut off before
+        int idx;
+        int width;
+        Read(s, &idx);
+        Read(s, &width);
+        if (s.fail || idx < 0 || idx >= block->comps.size())
+            break;
+        Component* comp = block->comps[idx];
+        if (comp->type == Component::Type::SPLITTER || comp->type == Component::Type::MERGER) {
+            SetBusWidth(static_cast<Splitter*>(comp), width);
+        } else if (comp->type == Component::Type::MACRO) {
+            SetMacroWidth(static_cast<Macro*>(comp), width);
+        } else if (comp->type == Component::Type::RAM || comp->type == Component::Type::ROM) {
+            int dataWidth;
+            std::string tail;
+            Read(s, &dataWidth);
+            Read(s, &tail);
+            if (!s.fail)
+                SetMemoryWidths(static_cast<Memory*>(comp), width, dataWidth, tail);
+        }
+        break;
+    }
+    case JournalOp::SET_DELAY: {
+        int idx;
+        int delay;
+        Read(s, &idx);
+        Read(s, &delay);
+        if (s.fail || idx < 0 || idx >= block->comps.size() || block->comps[idx]->type != Component::Type::GATE)
+            break;
+        static_cast<Gate*>(block->comps[idx])->delay = std::max(1, std::min(delay, Gate::MAX_DELAY));
+        break;
+    }
+    case JournalOp::SET_MEMORY: {
+        int idx;
+        int addrWidth;
+        int dataWidth;
+        std::string contents;
+        Read(s, &idx);
+        Read(s, &addrWidth);
+        Read(s, &dataWidth);
+        Read(s, &contents);
+        if (s.fail || idx < 0 || idx >= block->comps.size())
+            break;
+        Component* comp = block->comps[idx];
+        if (comp->type == Component::Type::RAM || comp->type == Component::Type::ROM)
+            SetMemory(static_cast<Memory*>(comp), addrWidth, dataWidth, contents);
+        break;
+    }
+    case JournalOp::LOAD_MEMORY: {
+        // The image is read again, a file changed since is not loaded
+        int idx;
+        std::string path;
+        uint64_t hash;
+        Read(s, &idx);
+        Read(s, &path);
+        Read(s, &hash);
+        if (s.fail || idx < 0 || idx >= block->comps.size())
+            break;
+        Component* comp = block->comps[idx];
+        if (comp->type != Component::Type::RAM && comp->type != Component::Type::ROM)
+            break;
+        Memory* memory = static_cast<Memory*>(comp);
+        std::string old = std::move(memory->contents);
+        if (!memory->LoadImage(path.c_str()) || Hash(memory->contents.data(), memory->contents.size()) != hash) {
+            memory->contents = std::move(old);
+            Log(TextFormat("Cannot read %s as it was", path.c_str()));
+            break;
+        }
+        engine.ForgetMemory(memory);
+        break;
+    }
+    }
+
+    block = current;
+}
+
+// Journals the user's edit on the current block, undo holds the records reverting it
+void Symulator::Record(JournalOp op, const std::string& data, std::vector<Edit> undo) {
+    Record({ { op, data } }, std::move(undo));
+}
+
+// Edits made together are undone together
+void Symulator::Record(std::vector<Edit> redo, std::vector<Edit> undo) {
+    for (auto& edit : redo)
+        Journal(edit.op, block, edit.data);
+    undoSteps.push_back({ block, std::move(undo), std::move(redo) });
+    if (undoSteps.size() > UNDO_LIMIT)
+        undoSteps.erase(undoSteps.begin());
+    redoSteps.clear();
+}
+
+// Edits go through the journal too, so replaying it after a crash gives the same board
+void Symulator::ApplyEdits(Block* target, const std::vector<Edit>& edits) {
+    for (auto& edit : edits) {
+        Reader s(edit.data.data(), edit.data.size());
+        s.version = PROJECT_VERSION;
+        ApplyJournal(edit.op, target, s);
+        Journal(edit.op, target, edit.data);
     }
 }
 
+void Symulator::Undo() {
+    if (undoSteps.empty())
+        return;
+    UndoStep step = std::move(undoSteps.back());
+    undoSteps.pop_back();
+    selection.clear();
+    ApplyEdits(step.target, step.undo);
+    redoSteps.push_back(std::move(step));
+}
+
+void Symulator::Redo() {
+    if (redoSteps.empty())
+        return;
+    UndoStep step = std::move(redoSteps.back());
+    redoSteps.pop_back();
+    selection.clear();
+    ApplyEdits(step.target, step.redo);
+    undoSteps.push_back(std::move(step));
+}
+
+void Symulator::ClearHistory() {
+    undoSteps.clear();
+    redoSteps.clear();
+}
+
 void Symulator::ClearProject() {
+    block = &mainBlock;
+    DeleteAll();
+    ClearHistory();
+    engine.Clear();
+    engine.instanceMemories.clear();
+    engine.savedMemories.clear();
+
     // Delete blocks
     int steps = compMenu.size() - numStdMenuElems;
     for (int i = 0; i < steps; i++) {
         compMenuNextX -= Block::WIDTH + 20;
+        delete compMenu.back();
         compMenu.pop_back();
     }
-
-    for (auto &conn : block->connections)
-        delete conn;
-    block->connections.clear();
-    for (auto &comp : block->comps)
-        delete comp;
-    block->comps.clear();
 }
 
 void Symulator::Update() {
@@ -1239,23 +4186,158 @@ void Symulator::Update() {
             MoveComponentMenu(-5.0);
         }
 
+        Block* viewed = block;
         if (IsKeyDown(KEY_LEFT_SHIFT)) {
             Component *comp = CheckComponentMenu(pos);
             if (comp && comp->type == Component::Type::BLOCK) {
                 block = static_cast<Block*>(comp);
+                block->Load();
             }
         } else {
             block = &mainBlock;
         }
+        if (block != viewed)
+            selection.clear();
+
+        if (IsKeyDown(KEY_LEFT_CONTROL)) {
+            if (IsKeyPressed(KEY_Z)) {
+                if (IsKeyDown(KEY_LEFT_SHIFT))
+                    Redo();
+                else
+                    Undo();
+                return;
+            }
+            if (IsKeyPressed(KEY_Y)) {
+                Redo();
+                return;
+            }
+            if (IsKeyPressed(KEY_C)) {
+                CopySelection();
+                return;
+            }
+            if (IsKeyPressed(KEY_V)) {
+                Paste();
+                return;
+            }
+        }
+        if (IsKeyPressed(KEY_F4))
+            SetFourState(!Connector::nets.fourState);
+        if (IsKeyPressed(KEY_F5))
+            SetTimed(!engine.timed);
+        if (IsKeyPressed(KEY_F6))
+            showCritical = !showCritical;
+        if (IsKeyPressed(KEY_DELETE)) {
+            DeleteSelection();
+            return;
+        }
+        // A file dropped on a memory becomes its contents
+        if (IsFileDropped()) {
+            int count;
+            char** files = GetDroppedFiles(&count);
+            Component* comp = CheckComponents(pos);
+            if (count > 0 && comp && (comp->type == Component::Type::RAM || comp->type == Component::Type::ROM)) {
+                Memory* memory = static_cast<Memory*>(comp);
+                // The file is journaled by its path and hash, only undoing keeps the old contents
+                std::string old = memory->contents;
+                if (memory->LoadImage(files[0])) {
+                    int idx = std::find(block->comps.begin(), block->comps.end(), comp) - block->comps.begin();
+                    int addrWidth = memory->AddrWidth();
+                    int dataWidth = memory->DataWidth();
+                    uint64_t hash = Hash(memory->contents.data(), memory->contents.size());
+                    engine.ForgetMemory(memory);
+                    Record(JournalOp::LOAD_MEMORY, Pack(idx, std::string(files[0]), hash),
+                           { { JournalOp::SET_MEMORY, Pack(idx, addrWidth, dataWidth, std::move(old)) } });
+                    Log(TextFormat("Loaded %d bytes into %s", (int)memory->contents.size(), memory->text.c_str()));
+                } else {
+                    Log(TextFormat("Cannot read %s", files[0]));
+                }
+            }
+            ClearDroppedFiles();
+        }
+        // Scrolling over a gate adds or removes inputs, over a splitter or merger it changes the bus width
+        float wheel = GetMouseWheelMove();
+        if (wheel != 0) {
+            Component* comp = CheckComponents(pos);
+            if (comp && (comp->type == Component::Type::SPLITTER || comp->type == Component::Type::MERGER)) {
+                Splitter* splitter = static_cast<Splitter*>(comp);
+                int width = std::max(2, std::min(splitter->Width() + (wheel > 0 ? 1 : -1), 64));
+                if (width != splitter->Width()) {
+                    int idx = std::find(block->comps.begin(), block->comps.end(), comp) - block->comps.begin();
+                    std::vector<Edit> undo = { { JournalOp::SET_WIDTH, Pack(idx, splitter->Width()) } };
+                    SaveLines(undo, *block, nullptr, &splitter->Bus());
+                    for (int i = width; i < splitter->Width(); i++)
+                        SaveLines(undo, *block, nullptr, &splitter->Bits()[i]);
+                    Record(JournalOp::SET_WIDTH, Pack(idx, width), std::move(undo));
+                    SetBusWidth(splitter, width);
+                }
+            } else if (comp && comp->type == Component::Type::MACRO) {
+                Macro* macro = static_cast<Macro*>(comp);
+                int width = std::max(1, std::min(macro->Width() + (wheel > 0 ? 1 : -1), Macro::MaxWidth(macro->kind)));
+                if (width != macro->Width()) {
+                    int idx = std::find(block->comps.begin(), block->comps.end(), comp) - block->comps.begin();
+                    std::vector<Edit> undo = { { JournalOp::SET_WIDTH, Pack(idx, macro->Width()) } };
+                    for (auto port : ResizedPorts(macro, width))
+                        SaveLines(undo, *block, nullptr, port);
+                    Record(JournalOp::SET_WIDTH, Pack(idx, width), std::move(undo));
+                    SetMacroWidth(macro, width);
+                }
+            } else if (comp && (comp->type == Component::Type::RAM || comp->type == Component::Type::ROM)) {
+                // With Shift held the address width changes instead of the data width
+                Memory* memory = static_cast<Memory*>(comp);
+                int step = wheel > 0 ? 1 : -1;
+                bool address = IsKeyDown(KEY_LEFT_SHIFT);
+                int addrWidth = std::max(1, std::min(memory->AddrWidth() + (address ? step : 0), Memory::MAX_ADDRESS));
+                int dataWidth = std::max(1, std::min(memory->DataWidth() + (address ? 0 : step), 64));
+                if (addrWidth != memory->AddrWidth() || dataWidth != memory->DataWidth()) {
+                    // Only the contents cut off by getting smaller are kept for undo
+                    int idx = std::find(block->comps.begin(), block->comps.end(), comp) - block->comps.begin();
+                    size_t size = (size_t(1) << addrWidth) * ((dataWidth + 7) / 8);
+                    std::string tail = memory->contents.size() > size ? memory->contents.substr(size) : std::string();
+                    std::vector<Edit> undo = { { JournalOp::SET_WIDTH, Pack(idx, memory->AddrWidth(), memory->DataWidth(), std::move(tail)) } };
+                    for (auto port : ResizedPorts(memory, addrWidth, dataWidth))
+                        SaveLines(undo, *block, nullptr, port);
+                    Record(JournalOp::SET_WIDTH, Pack(idx, addrWidth, dataWidth, std::string()), std::move(undo));
+                    SetMemoryWidths(memory, addrWidth, dataWidth, {});
+                }
+            } else if (comp && comp->type == Component::Type::GATE && IsKeyDown(KEY_LEFT_SHIFT)) {
+                // With Shift held the gate's delay changes
+                Gate* gate = static_cast<Gate*>(comp);
+                int delay = std::max(1, std::min(gate->delay + (wheel > 0 ? 1 : -1), Gate::MAX_DELAY));
+                if (delay != gate->delay) {
+                    int idx = std::find(block->comps.begin(), block->comps.end(), comp) - block->comps.begin();
+                    Record(JournalOp::SET_DELAY, Pack(idx, delay), { { JournalOp::SET_DELAY, Pack(idx, gate->delay) } });
+                    gate->delay = delay;
+                }
+            } else if (comp && comp->type == Component::Type::GATE && !static_cast<Gate*>(comp)->FixedInputs()) {
+                Gate* gate = static_cast<Gate*>(comp);
+                int count = std::max(2, std::min<int>(gate->inConns.size() + (wheel > 0 ? 1 : -1), Gate::MAX_INPUTS));
+                if (count != gate->inConns.size()) {
+                    int idx = std::find(block->comps.begin(), block->comps.end(), comp) - block->comps.begin();
+                    std::vector<Edit> undo = { { JournalOp::SET_INPUTS, Pack(idx, (int)gate->inConns.size()) } };
+                    for (int i = count; i < gate->inConns.size(); i++)
+                        SaveLines(undo, *block, nullptr, &gate->inConns[i]);
+                    Record(JournalOp::SET_INPUTS, Pack(idx, count), std::move(undo));
+                    SetGateInputs(gate, count);
+                }
+            }
+        }
         if (IsMouseButtonPressed(MOUSE_LEFT_BUTTON)) {
             if (IsKeyDown(KEY_LEFT_CONTROL)) {
                 Connector *conn = CheckComponentEndpoints(pos);
                 if (conn) {
+                    std::vector<Edit> undo;
+                    SaveLines(undo, *block, nullptr, conn);
+                    Record(JournalOp::DELETE_CONNECTION, Pack(GetComponentIdx(block->comps, conn)), std::move(undo));
                     DeleteConnection(conn);
                 } else {
                     Component *comp = CheckComponents(pos);
                     if (comp) {
+                        int idx = std::find(block->comps.begin(), block->comps.end(), comp) - block->comps.begin();
+                        std::vector<Edit> undo = { SaveComponent(block->comps, idx) };
+                        SaveLines(undo, *block, comp);
+                        Record(JournalOp::DELETE_COMPONENT, Pack(idx), std::move(undo));
                         DeleteComponent(comp);
+                        selection.erase(std::remove(selection.begin(), selection.end(), comp), selection.end());
                     }
                 }
                 return;
@@ -1268,14 +4350,28 @@ void Symulator::Update() {
                     blockDialog.Show(Dialog::Type::CREATE_BLOCK);
                     break;
                 case MenuOption::SAVE:
-                    SaveProject();
+                    if (IsKeyDown(KEY_LEFT_SHIFT)) {
+                        compress = !compress;
+                        WriteSnapshot();
+                    } else {
+                        SaveProject();
+                    }
                     break;
-                case MenuOption::CLEAR:
+                case MenuOption::CLEAR: {
+                    std::vector<Edit> undo;
+                    for (int i = 0; i < block->comps.size(); i++)
+                        undo.push_back(SaveComponent(block->comps, i));
+                    SaveLines(undo, *block, nullptr);
+                    Record(JournalOp::DELETE_ALL, {}, std::move(undo));
                     DeleteAll();
                     break;
+                }
                 case MenuOption::CLOSE:
+                    FinishSave(true);
+                    journal.close();
                     ClearProject();
                     name.clear();
+                    compress = false;
                     state = State::MENU;
                     break;
                 }
@@ -1285,39 +4381,76 @@ void Symulator::Update() {
         if (IsMouseButtonPressed(MOUSE_RIGHT_BUTTON)) {
             Component *in = CheckInputs(pos);
             if (in && in->type == Component::Type::INPUT1) {
-                in->outConns[0].value = !in->outConns[0].value;
+                Connector* out = &in->outConns[0];
+                out->SetValue(!out->Value());
+                CompIdx idx = GetComponentIdx(block->comps, out);
+                Record(JournalOp::SET_VALUE, Pack(idx, out->Value()), { { JournalOp::SET_VALUE, Pack(idx, !out->Value()) } });
             } else if (in && (in->type != Component::Type::INPUT1)) {
-                Connector *conn = CheckInputConnectors(pos);
-                if (conn) {
-                    conn->value = !conn->value;
+                InputBlock* ib = static_cast<InputBlock*>(in);
+                Connector *conn = ib->bus ? nullptr : CheckInputConnectors(pos);
+                int bit = ib->bus ? ib->BitAt(pos) : -1;
+                if (bit >= 0) {
+                    uint64_t old = ib->outConns[0].Word();
+                    ib->SetBit(bit, !ib->Bit(bit));
+                    CompIdx idx = GetComponentIdx(block->comps, &ib->outConns[0]);
+                    Record(JournalOp::SET_WORD, Pack(idx, ib->outConns[0].Word()), { { JournalOp::SET_WORD, Pack(idx, old) } });
+                } else if (conn) {
+                    conn->SetValue(!conn->Value());
+                    CompIdx idx = GetComponentIdx(block->comps, conn);
+                    Record(JournalOp::SET_VALUE, Pack(idx, conn->Value()), { { JournalOp::SET_VALUE, Pack(idx, !conn->Value()) } });
                 } else {
-                    InputBlock* ib = static_cast<InputBlock*>(in);
                     ib->isSigned = !ib->isSigned;
+                    int idx = std::find(block->comps.begin(), block->comps.end(), in) - block->comps.begin();
+                    Record(JournalOp::SET_SIGNED, Pack(idx, ib->isSigned), { { JournalOp::SET_SIGNED, Pack(idx, !ib->isSigned) } });
                 }
             } else if (Component* out = CheckOutputs(pos)) {
                 if (out->type != Component::Type::OUTPUT1) {
                     OutputBlock* ob = static_cast<OutputBlock*>(out);
                     ob->isSigned = !ob->isSigned;
+                    int idx = std::find(block->comps.begin(), block->comps.end(), out) - block->comps.begin();
+                    Record(JournalOp::SET_SIGNED, Pack(idx, ob->isSigned), { { JournalOp::SET_SIGNED, Pack(idx, !ob->isSigned) } });
                 }
             }
         }
 
+        // Middle click puts all bits of an input or output block on one bus connector, or back
+        if (IsMouseButtonPressed(MOUSE_MIDDLE_BUTTON)) {
+            Component* comp = CheckComponents(pos);
+            if (comp && IsBusBlock(comp)) {
+                bool bus = IsInputComponent(comp) ? static_cast<InputBlock*>(comp)->bus : static_cast<OutputBlock*>(comp)->bus;
+                int idx = std::find(block->comps.begin(), block->comps.end(), comp) - block->comps.begin();
+                std::vector<Edit> undo = { { JournalOp::SET_BUS, Pack(idx, bus) } };
+                SaveLines(undo, *block, comp);
+                Record(JournalOp::SET_BUS, Pack(idx, !bus), std::move(undo));
+                SetBus(comp, !bus);
+            }
+        }
+
         if (IsMouseButtonDown(MOUSE_LEFT_BUTTON)) {
             Log(TextFormat("x:%.0f y:%.0f", pos.x, pos.y));
 
             Component *comp = CheckComponentMenu(pos);
             if (comp) {
-                movingComp = Component::Clone(comp);
+                selection.clear();
+                movingComp = Component::Clone(comp, *block->arena);
+                movingComp->fromMenu = true;
                 block->comps.push_back(movingComp);
                 state = State::GATE_MOVING;
             } else if ((comp = CheckComponents(pos)) != nullptr) {
                 lineStart = comp->CheckEndpoints(pos);
                 if (lineStart) {
                     state = State::LINE_DRAWING;
+                } else if (std::find(selection.begin(), selection.end(), comp) != selection.end()) {
+                    state = State::SELECTION_MOVING;
                 } else {
+                    selection.clear();
                     movingComp = comp;
                     state = State::GATE_MOVING;
                 }
+            } else if (!CheckMenu(pos)) {
+                selection.clear();
+                selectStart = pos;
+                state = State::SELECTING;
             }
         }
     } else if (state == State::GATE_MOVING) {
@@ -1325,22 +4458,74 @@ void Symulator::Update() {
             movingComp->Move(GetMouseDelta());
             movingComp->collide = ComponentCollide(movingComp);
         } else {
+            bool isNew = movingComp->fromMenu;
+            movingComp->fromMenu = false;
+            state = State::ACTIVE;
             if (movingComp->collide) {
-                if (movingComp->prevPos.x >= 0 && movingComp->prevPos.y >= 0) {
+                if (!isNew) {
                     Vector2 delta = {movingComp->prevPos.x - movingComp->rect.x,
                                      movingComp->prevPos.y - movingComp->rect.y};
                     movingComp->Move(delta);
                     movingComp->collide = false;
                 } else {
                     block->comps.erase(std::remove(block->comps.begin(), block->comps.end(), movingComp), block->comps.end());
-                    delete movingComp;
+                    block->arena->Delete(movingComp);
+                    movingComp = nullptr;
+                    return;
                 }
+            } else if (isNew) {
+                std::ostringstream data(std::ios_base::binary);
+                movingComp->Save(data);
+                int idx = std::find(block->comps.begin(), block->comps.end(), movingComp) - block->comps.begin();
+                Record(JournalOp::ADD_COMPONENT, data.str(), { { JournalOp::DELETE_COMPONENT, Pack(idx) } });
+            } else if (movingComp->rect.x != movingComp->prevPos.x || movingComp->rect.y != movingComp->prevPos.y) {
+                int idx = std::find(block->comps.begin(), block->comps.end(), movingComp) - block->comps.begin();
+                Record(JournalOp::MOVE_COMPONENT, Pack(idx, Vector2{movingComp->rect.x, movingComp->rect.y}),
+                       { { JournalOp::MOVE_COMPONENT, Pack(idx, movingComp->prevPos) } });
             }
-            state = State::ACTIVE;
             movingComp->prevPos.x = movingComp->rect.x;
             movingComp->prevPos.y = movingComp->rect.y;
             movingComp = nullptr;
         }
+    } else if (state == State::SELECTING) {
+        if (!IsMouseButtonDown(MOUSE_LEFT_BUTTON)) {
+            Rectangle band = SelectionRect(selectStart, GetMousePosition());
+            for (auto& comp : block->comps) {
+                if (comp->rect.x >= band.x && comp->rect.y >= band.y &&
+                    comp->rect.x + comp->rect.width <= band.x + band.width &&
+                    comp->rect.y + comp->rect.height <= band.y + band.height)
+                    selection.push_back(comp);
+            }
+            state = State::ACTIVE;
+        }
+    } else if (state == State::SELECTION_MOVING) {
+        if (IsMouseButtonDown(MOUSE_LEFT_BUTTON)) {
+            Vector2 delta = GetMouseDelta();
+            for (auto& comp : selection)
+                comp->Move(delta);
+        } else {
+            // Collisions are checked once the whole selection is dropped, any of them puts everything back
+            state = State::ACTIVE;
+            bool collide = false;
+            for (auto& comp : selection)
+                collide = collide || ComponentCollide(comp);
+
+            std::vector<Edit> redo, undo;
+            for (auto idx : SelectionIndices()) {
+                Component* comp = block->comps[idx];
+                if (collide) {
+                    comp->Move({ comp->prevPos.x - comp->rect.x, comp->prevPos.y - comp->rect.y });
+                    continue;
+                }
+                if (comp->rect.x == comp->prevPos.x && comp->rect.y == comp->prevPos.y)
+                    continue;
+                redo.push_back({ JournalOp::MOVE_COMPONENT, Pack(idx, Vector2{ comp->rect.x, comp->rect.y }) });
+                undo.push_back({ JournalOp::MOVE_COMPONENT, Pack(idx, comp->prevPos) });
+                comp->prevPos = { comp->rect.x, comp->rect.y };
+            }
+            if (!redo.empty())
+                Record(std::move(redo), std::move(undo));
+        }
     } else if (state == State::LINE_DRAWING) {
         Vector2 pos = GetMousePosition();
         if (IsMouseButtonDown(MOUSE_LEFT_BUTTON)) {
@@ -1348,7 +4533,15 @@ void Symulator::Update() {
         } else {
             Connector* conn = CheckComponentEndpoints(pos);
             if (conn) {
-                AddConnection(block->connections, lineStart, conn);
+                size_t size = block->connections.size();
+                AddConnection(*block, lineStart, conn);
+                if (block->connections.size() != size) {
+                    // An input takes a single line, removing its lines removes just this one
+                    Connector* in = block->connections.back()->end;
+                    Record(JournalOp::ADD_CONNECTION,
+                           Pack(GetComponentIdx(block->comps, lineStart), GetComponentIdx(block->comps, conn)),
+                           { { JournalOp::DELETE_CONNECTION, Pack(GetComponentIdx(block->comps, in)) } });
+                }
             }
             state = State::ACTIVE;
         }
@@ -1369,8 +4562,16 @@ void Symulator::Update() {
         }
         mainMenu.Update();
     }
-    UpdateConnections(block->comps, block->connections);
+    if (engine.Stale(block))
+        engine.Compile(*block);
+    engine.Run();
     menu.Update();
+
+    // Autosave, done once the frame's edits are applied as records are written before some of them
+    FinishSave(false);
+    if (journal.is_open() && !saveThread.joinable() && journalRecords > 0 &&
+        GetTime() - lastSave > (journalRecords >= COMPACT_RECORDS ? 1.0 : AUTOSAVE_INTERVAL))
+        WriteSnapshot();
 }
 
 void Symulator::Draw() {
@@ -1396,7 +4597,14 @@ void Symulator::Draw() {
                 DrawTextEx(font, "LMB + Ctrl: Delete", { width - 150.0f, heigth - 35.0f }, 15, 1, RAYWHITE);
                 DrawTextEx(font, "RMB: Change value", { width - 300.0f, heigth - 35.0f }, 15, 1, RAYWHITE);
                 DrawTextEx(font, "Mouse + Shitf: Look into block", { width - 300.0f, heigth - 20.0f }, 15, 1, RAYWHITE);
+                DrawTextEx(font, "Ctrl + Z/Y: Undo/Redo", { width - 150.0f, heigth - 20.0f }, 15, 1, RAYWHITE);
             }
+            if (Connector::nets.fourState)
+                DrawTextEx(font, "F4: 0/1/X/Z", { GetScreenWidth() - 100.0f, 50.0f }, 15, 1, ORANGE);
+            if (engine.timed)
+                DrawTextEx(font, TextFormat("F5: t = %llu", (unsigned long long)engine.time), { GetScreenWidth() - 100.0f, 65.0f }, 15, 1, ORANGE);
+            if (showCritical)
+                DrawTextEx(font, TextFormat("F6: path = %d%s", engine.criticalDelay, engine.criticalLoop ? " + loop" : ""), { GetScreenWidth() - 100.0f, 80.0f }, 15, 1, GOLD);
         }
     }
 
@@ -1,31 +1,267 @@
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
 #include <string>
 #include <vector>
 #include <list>
+#include <map>
 #include <fstream>
+#include <memory>
+#include <new>
+#include <thread>
+#include <unordered_map>
+#include <unordered_set>
 
 #include "raylib.h"
 
 namespace sym {
 
 template <typename T>
-void Write(std::ofstream& os, T* data) {
+void Write(std::ostream& os, T* data) {
     os.write((const char*)data, sizeof(T));
 }
-void Write(std::ofstream &os, std::string *data);
+void Write(std::ostream &os, std::string *data);
+
+// Reads fields straight out of a project file loaded into memory in one go.
+// Reading past the end zeroes the destination and sets fail, like a stream would.
+class Reader {
+public:
+    Reader(const char *data, size_t size) : data(data), size(size) {}
+
+    void Read(void *dst, size_t count) {
+        if (count > size - pos) {
+            memset(dst, 0, count);
+            pos = size;
+            fail = true;
+            return;
+        }
+        memcpy(dst, data + pos, count);
+        pos += count;
+    }
+
+    const char *data;
+    size_t size;
+    size_t pos = 0;
+    int version = 0;
+    bool fail = false;
+    // Buffer holding data, set when parts of it may be parsed later
+    std::shared_ptr<const std::vector<char>> owner;
+};
 
 template <typename T>
-void Read(std::ifstream& is, T* data) {
-    char buffer[20];
-    is.read(buffer, sizeof(T));
-    *data = *(T*)buffer;
+void Read(Reader& is, T* data) {
+    is.Read(data, sizeof(T));
 }
-void Read(std::ifstream& is, std::string* data);
+void Read(Reader& is, std::string* data);
+
+// Memory for a block's components and lines. Objects are handed out from large chunks,
+// deleting one only runs its destructor and keeps the slot for the next object of that size;
+// the chunks are freed together with the arena.
+class Arena {
+public:
+    template <typename T, typename... Args>
+    T* New(Args&&... args) {
+        return new (Allocate(sizeof(T))) T(std::forward<Args>(args)...);
+    }
+
+    template <typename T>
+    void Delete(T* obj) {
+        if (!obj) return;
+        obj->~T();
+        // Objects are only deleted through the type they were created as or its first base
+        Header* header = (Header*)obj - 1;
+        freeSlots[header->size].push_back(header);
+    }
+
+private:
+    // Keeps the slot size, as components are deleted through their base class
+    union Header {
+        size_t size;
+        std::max_align_t align;
+    };
+    static constexpr size_t CHUNK_SIZE = 64 * 1024;
+
+    void* Allocate(size_t size) {
+        size = sizeof(Header) + (size + sizeof(Header) - 1) / sizeof(Header) * sizeof(Header);
+        Header* header;
+        auto& slots = freeSlots[size];
+        if (!slots.empty()) {
+            header = slots.back();
+            slots.pop_back();
+        } else {
+            if (used + size > chunkSize) {
+                chunkSize = std::max(size, CHUNK_SIZE);
+                chunks.emplace_back(new Header[chunkSize / sizeof(Header)]);
+                used = 0;
+            }
+            header = (Header*)((char*)chunks.back().get() + used);
+            used += size;
+        }
+        header->size = size;
+        return header + 1;
+    }
+
+    std::vector<std::unique_ptr<Header[]>> chunks;
+    size_t chunkSize = 0;
+    size_t used = 0;
+    std::unordered_map<size_t, std::vector<Header*>> freeSlots;
+};
+
+// Values of all nets packed into bits, connectors refer to the net they are on by its id.
+// Net 0 is never driven and reads as 0, unconnected inputs are on it. The rest of its word is
+// never handed out either, so an unconnected bus reads as 0 too.
+class NetState {
+public:
+    static constexpr int ZERO = 0;
+
+    // Levels of a net in four-state mode, the value bit and the unknown bit above it
+    enum Level { LOW = 0, HIGH = 1, HIGH_Z = 2, X = 3 };
+
+    NetState() : bits(1, 0), unknown(1, 0), compiled(1, 0), count(64) {}
+
+    // Counts removed nets the engine's compiled code refers to, that code is stale once it changes
+    uint64_t removed = 0;
+
+    int Add() {
+        int net;
+        if (!freeNets.empty()) {
+            net = freeNets.back();
+            freeNets.pop_back();
+        } else {
+            net = count++;
+            if ((net & 63) == 0) {
+                bits.push_back(0);
+                unknown.push_back(0);
+                compiled.push_back(0);
+            }
+        }
+        Drive(net, false);
+        return net;
+    }
+    // Nets of a bus follow one another within one 64-bit word, so its value is read with a single shift
+    int AddRange(int width) {
+        if (width == 1)
+            return Add();
+        if ((count & 63) + width > 64) {
+            while (count & 63)
+                freeNets.push_back(count++);
+        }
+        int net = count;
+        count += width;
+        while (bits.size() * 64 < (size_t)count) {
+            bits.push_back(0);
+            unknown.push_back(0);
+            compiled.push_back(0);
+        }
+        DriveWord(net, width, 0);
+        return net;
+    }
+    void Remove(int net) {
+        if (net == ZERO)
+            return;
+        freeNets.push_back(net);
+        uint64_t mask = uint64_t(1) << (net & 63);
+        if (compiled[net >> 6] & mask) {
+            compiled[net >> 6] &= ~mask;
+            removed++;
+        }
+    }
+    void RemoveRange(int net, int width) {
+        if (net == ZERO)
+            return;
+        for (int i = 0; i < width; i++)
+            Remove(net + i);
+    }
+    // Marks the nets compiled code refers to, until the next compile
+    void SetCompiled(int net) { compiled[net >> 6] |= uint64_t(1) << (net & 63); }
+    void ClearCompiled() { std::fill(compiled.begin(), compiled.end(), 0); }
+    bool Get(int net) const { return bits[net >> 6] >> (net & 63) & 1; }
+    void Set(int net, bool value) {
+        uint64_t mask = uint64_t(1) << (net & 63);
+        if (value)
+            bits[net >> 6] |= mask;
+        else
+            bits[net >> 6] &= ~mask;
+    }
+    static uint64_t Mask(int width) { return width >= 64 ? ~uint64_t(0) : (uint64_t(1) << width) - 1; }
+    uint64_t GetWord(int net, int width) const { return bits[net >> 6] >> (net & 63) & Mask(width); }
+    void SetWord(int net, int width, uint64_t value) {
+        uint64_t mask = Mask(width) << (net & 63);
+        bits[net >> 6] = (bits[net >> 6] & ~mask) | (value << (net & 63) & mask);
+    }
+
+    // Second bit plane for four-state mode, a set bit makes the value bit read as X when set and Z when not.
+    // Two-state evaluation never looks at it.
+    bool Unknown(int net) const { return unknown[net >> 6] >> (net & 63) & 1; }
+    void SetUnknown(int net, bool value) {
+        uint64_t mask = uint64_t(1) << (net & 63);
+        if (value)
+            unknown[net >> 6] |= mask;
+        else
+            unknown[net >> 6] &= ~mask;
+    }
+    uint64_t GetUnknownWord(int net, int width) const { return unknown[net >> 6] >> (net & 63) & Mask(width); }
+    void SetUnknownWord(int net, int width, uint64_t value) {
+        uint64_t mask = Mask(width) << (net & 63);
+        unknown[net >> 6] = (unknown[net >> 6] & ~mask) | (value << (net & 63) & mask);
+    }
+    int GetLevel(int net) const { return Get(net) | Unknown(net) << 1; }
+    // Sets a known value, as inputs do
+    void Drive(int net, bool value) {
+        Set(net, value);
+        SetUnknown(net, false);
+    }
+    void DriveWord(int net, int width, uint64_t value) {
+        SetWord(net, width, value);
+        SetUnknownWord(net, width, 0);
+    }
+    // Nets not driven by anything read as Z in four-state mode and as 0 otherwise. Leaving it, X and Z
+    // read as 0 too, so registers never clocked do not come out as all ones.
+    void SetFourState(bool on) {
+        fourState = on;
+        for (size_t i = 0; i < bits.size(); i++)
+            bits[i] &= ~unknown[i];
+        std::fill(unknown.begin(), unknown.end(), 0);
+        unknown[0] = on ? ~uint64_t(0) : 0;
+    }
+
+    bool fourState = false;
+
+private:
+    std::vector<uint64_t> bits;
+    std::vector<uint64_t> unknown;
+    std::vector<uint64_t> compiled;
+    std::vector<int> freeNets;
+    int count = 0;
+};
 
 class Gate;
 class Component;
+class Connector;
 class Line;
 class Symulator;
 
+// Refers to a connector by its component and place in inConns/outConns, so it stays valid
+// when the component's connector vectors are reallocated. Converts to and from Connector*.
+struct ConnectorHandle {
+    Component* comp = nullptr;
+    bool out = false;
+    int idx = 0;
+
+    ConnectorHandle() {}
+    ConnectorHandle(std::nullptr_t) {}
+    ConnectorHandle(Connector* conn);
+
+    Connector* Get() const;
+    operator Connector*() const { return Get(); }
+    Connector* operator->() const { return Get(); }
+};
+
+struct CompIdx;
+using ConnectorIndex = std::unordered_map<const Connector*, CompIdx>;
+
 class Connector {
 public:
     enum class Type {
@@ -33,18 +269,40 @@ public:
         OUT,
     } type;
     Vector2 pos;
-    bool value = false;
     Component* parent;
-    Connector* conn; // bypass
+    ConnectorHandle conn; // bypass
+    // Bits carried, a bus is on width nets following its first one
+    int width = 1;
+    // Outputs drive a net of their own, inputs are on the net of the output wired to them
+    int net;
+    // Input with more than one driver, on a net of its own the engine resolves the drivers into
+    bool resolved = false;
 
-    Connector(Component* parent, Vector2 pos, Type type): parent(parent), pos(pos), type(type), conn(nullptr) {}
-    Connector(Component *parent, Vector2 pos, Type type, Connector* conn)
-        : parent(parent), pos(pos), type(type), conn(conn) {}
-    Connector(Vector2 pos, Type type) : parent(nullptr), pos(pos), type(type), conn(nullptr) {}
-    Connector() : parent(nullptr), pos({0, 0}), type(Type::IN), conn(nullptr) {}
-    Connector(std::ifstream& s, Component* parent);
+    static NetState nets;
+    // Off while a library block is written, its entry must not change with the values simulated in it
+    static bool saveValues;
 
-    void Save(std::ofstream &s);
+    Connector(Component* parent, Vector2 pos, Type type, int width = 1)
+        : parent(parent), pos(pos), type(type), conn(nullptr), width(width), net(NewNet(type, width)) {}
+    Connector(Component *parent, Vector2 pos, Type type, ConnectorHandle conn, int width = 1)
+        : parent(parent), pos(pos), type(type), conn(conn), width(width), net(NewNet(type, width)) {}
+    Connector(Vector2 pos, Type type) : parent(nullptr), pos(pos), type(type), conn(nullptr), net(NewNet(type, 1)) {}
+    Connector() : parent(nullptr), pos({0, 0}), type(Type::IN), conn(nullptr), net(NetState::ZERO) {}
+    Connector(Reader& s, Component* parent);
+
+    static int NewNet(Type type, int width) { return type == Type::OUT ? nets.AddRange(width) : NetState::ZERO; }
+    bool Value() const { return nets.Get(net); }
+    void SetValue(bool value) { nets.Drive(net, value); }
+    uint64_t Word() const { return nets.GetWord(net, width); }
+    void SetWord(uint64_t value) { nets.DriveWord(net, width, value); }
+    uint64_t UnknownWord() const { return nets.GetUnknownWord(net, width); }
+    void Save(std::ostream &s, const ConnectorIndex *index = nullptr);
+};
+
+struct CompIdx {
+    int compIdx;
+    Connector::Type type;
+    int connIdx;
 };
 
 class Component {
@@ -59,71 +317,118 @@ public:
         OUTPUT4,
         OUTPUT8,
         GATE,
-        BLOCK
+        BLOCK,
+        SPLITTER,
+        MERGER,
+        MACRO,
+        RAM,
+        ROM
     } type;
 
-    static Component *Clone(Component *comp);
+    static Component *Clone(Component *comp, Arena& arena);
 
     Component(float x, float y, float width, float height, const char *text, Type type, bool singleInput = false)
-        : rect({x, y, width, height}), prevPos({-1, -1}), text(text), type(type) {
+        : rect({x, y, width, height}), prevPos({x, y}), text(text), type(type) {
     }
 
     Component(const Component *comp)
-        : rect(comp->rect), prevPos({-1, -1}), text(comp->text), type(comp->type),
+        : rect(comp->rect), prevPos({comp->rect.x, comp->rect.y}), text(comp->text), type(comp->type),
           inConns(comp->inConns), outConns(comp->outConns) {
-        for (auto& in : inConns)
+        for (auto& in : inConns) {
             in.parent = this;
-        for (auto& out : outConns)
+            in.net = NetState::ZERO;
+            in.resolved = false;
+        }
+        for (auto& out : outConns) {
             out.parent = this;
+            out.net = Connector::nets.AddRange(out.width);
+        }
     }
     Component() {}
-    Component(std::ifstream& s, Type type): prevPos({ -1, -1 }), type(type) {
+    Component(Reader& s, Type type): type(type) {
         Read(s, &rect);
         Read(s, &text);
+        prevPos = { rect.x, rect.y };
     }
 
-    virtual void Calc(std::vector<Connector*>& outConns) { }
     virtual void Draw();
     virtual void Move(const Vector2 &delta);
+    virtual void PlaceConnectors() {}
     virtual Connector* CheckEndpoints(const Vector2& pos);
-    virtual void Save(std::ofstream& s);
-    virtual ~Component() {};
+    virtual void Save(std::ostream& s);
+    virtual ~Component() {
+        for (auto& out : outConns)
+            Connector::nets.RemoveRange(out.net, out.width);
+        for (auto& in : inConns) {
+            if (in.resolved)
+                Connector::nets.RemoveRange(in.net, in.width);
+        }
+    }
 
     Rectangle rect;
     Vector2 prevPos;
     std::string text;
     bool collide = false;
+    // Taken from the component menu and not dropped on the board yet
+    bool fromMenu = false;
     std::vector<Connector> inConns;
     std::vector<Connector> outConns;
 };
 
+inline ConnectorHandle::ConnectorHandle(Connector* conn) {
+    if (!conn)
+        return;
+    comp = conn->parent;
+    out = conn->type == Connector::Type::OUT;
+    idx = (int)(conn - (out ? comp->outConns.data() : comp->inConns.data()));
+}
+
+inline Connector* ConnectorHandle::Get() const {
+    if (!comp)
+        return nullptr;
+    return out ? &comp->outConns[idx] : &comp->inConns[idx];
+}
+
 class Gate : public Component {
 public:
     enum class Type {
         NOT,
         AND,
         OR,
-        XOR
+        XOR,
+        // Only made by the engine, copies a block's output from inside it
+        BUF,
+        NAND,
+        NOR,
+        XNOR,
+        // Drives its first input when the second one is set, Z otherwise
+        TRI
     } gateType;
 
     static constexpr float WIDTH = 75;
     static constexpr float HEIGHT = 30;
+    // The engine evaluates a gate's inputs as one 64-bit word
+    static constexpr int MAX_INPUTS = 64;
+    // In ticks of timed simulation, below the size of the engine's timing wheel
+    static constexpr int MAX_DELAY = 255;
 
-    Gate(float x, float y, const char *text, Gate::Type gateType, bool singleInput = false)
-        : Component(x, y, WIDTH, HEIGHT, text, Component::Type::GATE, singleInput), gateType(gateType) {
-        if (singleInput) {
+    Gate(float x, float y, const char *text, Gate::Type gateType, int numInputs = 2)
+        : Component(x, y, WIDTH, HEIGHT, text, Component::Type::GATE), gateType(gateType) {
+        for (int i = 0; i < numInputs; i++)
             inConns.push_back(Connector(this, {x + 5, y + 15}, Connector::Type::IN));
-        } else {
-            inConns.push_back(Connector(this, {x + 5, y + 5}, Connector::Type::IN));
-            inConns.push_back(Connector(this, {x + 5, y + 25}, Connector::Type::IN));
-        }
         outConns.push_back(Connector(this, {x + 70, y + 15}, Connector::Type::OUT));
+        PlaceConnectors();
     }
-    Gate(const Gate* gate) : Component(gate), gateType(gate->gateType) {}
-    Gate(std::ifstream&, Component::Type type);
-    virtual void Calc(std::vector<Connector*>& outConns) override;
+    Gate(const Gate* gate) : Component(gate), gateType(gate->gateType), delay(gate->delay) {}
+    Gate(Reader&, Component::Type type);
+    bool FixedInputs() const { return gateType == Type::NOT || gateType == Type::BUF || gateType == Type::TRI; }
+    void SetInputs(int count);
     virtual void Draw() override;
-    virtual void Save(std::ofstream& s) override;
+    virtual void PlaceConnectors() override;
+    virtual void Save(std::ostream& s) override;
+
+    // Ticks from an input change to the output change in timed simulation
+    int delay = 1;
 };
 
 class Input : public Component {
@@ -134,12 +439,13 @@ public:
 
     Input(float x, float y, const char* text)
         : Component(x, y, WIDTH, HEIGHT, text, Component::Type::INPUT1) {
-        outConns.push_back(Connector(nullptr, {x + 35, y + 15}, Connector::Type::OUT));
+        outConns.push_back(Connector(this, {x + 35, y + 15}, Connector::Type::OUT));
     }
     Input(const Input* in) : Component(in) { text = nextText++; }
-    Input(std::ifstream& s, Component::Type type);
+    Input(Reader& s, Component::Type type);
     virtual void Draw() override;
-    virtual void Save(std::ofstream& s) override;
+    virtual void PlaceConnectors() override;
+    virtual void Save(std::ostream& s) override;
 };
 
 class InputBlock : public Component {
@@ -151,7 +457,7 @@ public:
     InputBlock(float x, float y, Component::Type type, const char *text)
         : Component(x, y, WIDTH, HEIGHT, text, type) {
 
-        outConns.push_back(Connector(nullptr, {x + WIDTH - 5, y + 15}, Connector::Type::OUT));
+        outConns.push_back(Connector(this, {x + WIDTH - 5, y + 15}, Connector::Type::OUT));
     }
     InputBlock(const InputBlock *in) : Component(in), isIcon(false) {
 
@@ -169,17 +475,27 @@ public:
         }
 
         for (int i = 1; i < numConnectors; i++) {
-            outConns.push_back(Connector(nullptr, {rect.x + WIDTH - 5, rect.y + 15 + 15 * i}, Connector::Type::OUT));
+            outConns.push_back(Connector(this, {rect.x + WIDTH - 5, rect.y + 15 + 15 * i}, Connector::Type::OUT));
         }
         char name = nextText++;
         rect.height = 15 + 15 * outConns.size();
     }
-    InputBlock(std::ifstream&, Type type);
+    InputBlock(Reader&, Type type);
+    int Bits() const { return bus ? outConns[0].width : outConns.size(); }
+    // Bits are numbered from the top, the first one is the highest
+    bool Bit(int i) const { return bus ? outConns[0].Word() >> (Bits() - 1 - i) & 1 : outConns[i].Value(); }
+    void SetBit(int i, bool value);
+    Vector2 BitPos(int i) const { return {rect.x + WIDTH - 5, rect.y + 15 + 15 * i}; }
+    int BitAt(const Vector2& pos) const;
+    void SetBus(bool bus);
     virtual void Draw() override;
-    virtual void Save(std::ofstream& s) override;
+    virtual void PlaceConnectors() override;
+    virtual void Save(std::ostream& s) override;
 
     bool isIcon = true;
     bool isSigned = false;
+    // All bits go out on one bus connector
+    bool bus = false;
 };
 
 class Output : public Component {
@@ -189,12 +505,13 @@ public:
 
     Output(float x, float y, const char *text)
         : Component(x, y, WIDTH, HEIGHT, text, Component::Type::OUTPUT1) {
-        inConns.push_back(Connector(nullptr, {x + 5, y + 15}, Connector::Type::IN));
+        inConns.push_back(Connector(this, {x + 5, y + 15}, Connector::Type::IN));
     }
     Output(const Output* out) : Component(out) {}
-    Output(std::ifstream&, Type type);
+    Output(Reader&, Type type);
     virtual void Draw() override;
-    virtual void Save(std::ofstream& s) override;
+    virtual void PlaceConnectors() override;
+    virtual void Save(std::ostream& s) override;
 };
 
 class OutputBlock : public Component {
@@ -205,7 +522,7 @@ class OutputBlock : public Component {
     OutputBlock(float x, float y, Component::Type type, const char *text)
         : Component(x, y, WIDTH, HEIGHT, text, type) {
         // Only one - because only this is needed in menu
-        inConns.push_back(Connector(nullptr, {x + 5, y + 15}, Connector::Type::IN));
+        inConns.push_back(Connector(this, {x + 5, y + 15}, Connector::Type::IN));
     }
     OutputBlock(const OutputBlock *out) : Component(out), isIcon(false) {
         int numConnectors = 0;
@@ -223,15 +540,130 @@ class OutputBlock : public Component {
 
         // First already added
         for (int i = 1; i < numConnectors; i++) {
-            inConns.push_back(Connector(nullptr, {rect.x + 5, rect.y + 15 + 15 * i}, Connector::Type::IN));
+            inConns.push_back(Connector(this, {rect.x + 5, rect.y + 15 + 15 * i}, Connector::Type::IN));
         }
         rect.height = 15 + 15 * inConns.size();
     }
-    OutputBlock(std::ifstream&, Type type);
+    OutputBlock(Reader&, Type type);
+    int Bits() const { return bus ? inConns[0].width : inConns.size(); }
+    bool Bit(int i) const { return bus ? inConns[0].Word() >> (Bits() - 1 - i) & 1 : inConns[i].Value(); }
+    int BitLevel(int i) const {
+        if (!bus)
+            return Connector::nets.GetLevel(inConns[i].net);
+        return Bit(i) | (inConns[0].UnknownWord() >> (Bits() - 1 - i) & 1) << 1;
+    }
+    Vector2 BitPos(int i) const { return {rect.x + (bus ? 15 : 5), rect.y + 15 + 15 * i}; }
+    void SetBus(bool bus);
     virtual void Draw() override;
-    virtual void Save(std::ofstream&) override;
+    virtual void PlaceConnectors() override;
+    virtual void Save(std::ostream&) override;
     bool isIcon = true;
     bool isSigned = false;
+    // All bits come in on one bus connector
+    bool bus = false;
+};
+
+// Splits a bus into its bits, or merges bits into a bus as MERGER. The first bit connector is the
+// highest bit, as on input and output blocks.
+class Splitter : public Component {
+public:
+    static constexpr float WIDTH = 30;
+    static constexpr float HEIGHT = 30;
+
+    Splitter(float x, float y, Component::Type type, const char *text, int width = 2)
+        : Component(x, y, WIDTH, HEIGHT, text, type) {
+        SetWidth(width);
+    }
+    Splitter(const Splitter* splitter) : Component(splitter) {}
+    Splitter(Reader&, Component::Type type);
+    bool Merger() const { return type == Component::Type::MERGER; }
+    int Width() const { return Merger() ? inConns.size() : outConns.size(); }
+    Connector& Bus() { return Merger() ? outConns[0] : inConns[0]; }
+    std::vector<Connector>& Bits() { return Merger() ? inConns : outConns; }
+    // Lines on connectors going away or changing width are deleted by the caller first
+    void SetWidth(int width);
+    virtual void Draw() override;
+    virtual void PlaceConnectors() override;
+    virtual void Save(std::ostream& s) override;
+};
+
+// Word-level component evaluated with native integer operations on its bus ports
+class Macro : public Component {
+public:
+    enum class Kind {
+        ADD, // A + B + CI, carry out
+        SUB, // A - B - BI, borrow out
+        CMP, // unsigned A < B, A == B, A > B
+        MUX, // S ? B : A
+        DEC, // one hot bit at A
+        SHF, // R ? A >> N : A << N
+        REG, // takes D on the rising edge of CLK
+        // Only made by the engine, for memories and for inputs with more than one driver
+        RAM,
+        ROM,
+        RESOLVE
+    } kind;
+
+    static constexpr float WIDTH = 60;
+    static constexpr float HEIGHT = 30;
+
+    Macro(float x, float y, const char *text, Kind kind, int width = 8)
+        : Component(x, y, WIDTH, HEIGHT, text, Component::Type::MACRO), kind(kind) {
+        SetWidth(width);
+    }
+    Macro(const Macro* macro) : Component(macro), kind(macro->kind), width(macro->width) {}
+    Macro(Reader&, Component::Type type);
+    static int MaxWidth(Kind kind) { return kind == Kind::DEC ? 6 : 64; }
+    // Widths of the inputs and outputs of a macro of the given data width
+    static void PortWidths(Kind kind, int width, std::vector<int>& ins, std::vector<int>& outs);
+    int Width() const { return width; }
+    // Lines on ports changing width are deleted by the caller first
+    void SetWidth(int width);
+    virtual void Draw() override;
+    virtual void PlaceConnectors() override;
+    virtual void Save(std::ostream& s) override;
+
+private:
+    int width = 0;
+};
+
+// RAM or ROM of 2^addrWidth words. The contents hold each word in WordBytes() bytes, lowest byte first,
+// and only go as far as the last word written or loaded, the words after it read as 0. RAM writes D at A
+// on the rising edge of CLK when WE is set, both read the word at A.
+class Memory : public Component {
+public:
+    static constexpr float WIDTH = 60;
+    static constexpr float HEIGHT = 30;
+    static constexpr int MAX_ADDRESS = 20;
+
+    Memory(float x, float y, Component::Type type, const char *text, int addrWidth = 8, int dataWidth = 8)
+        : Component(x, y, WIDTH, HEIGHT, text, type) {
+        SetWidths(addrWidth, dataWidth);
+    }
+    Memory(const Memory* memory)
+        : Component(memory), contents(memory->contents), addrWidth(memory->addrWidth), dataWidth(memory->dataWidth) {}
+    Memory(Reader&, Component::Type type);
+    bool Rom() const { return type == Component::Type::ROM; }
+    int AddrWidth() const { return addrWidth; }
+    int DataWidth() const { return dataWidth; }
+    int WordBytes() const { return (dataWidth + 7) / 8; }
+    size_t MaxBytes() const { return (size_t(1) << addrWidth) * WordBytes(); }
+    static void PortWidths(Component::Type type, int addrWidth, int dataWidth, std::vector<int>& ins, std::vector<int>& outs);
+    static uint64_t Load(const std::string& contents, uint64_t addr, int wordBytes);
+    static void Store(std::string& contents, uint64_t addr, int wordBytes, uint64_t value);
+    // Lines on ports changing width are deleted by the caller first, contents past the new size are dropped
+    void SetWidths(int addrWidth, int dataWidth);
+    // Contents are the file's bytes, as much of it as fits
+    bool LoadImage(const char* path);
+    virtual void Draw() override;
+    virtual void PlaceConnectors() override;
+    virtual void Save(std::ostream& s) override;
+
+    std::string contents;
+
+private:
+    int addrWidth = 0;
+    int dataWidth = 0;
 };
 
 class Block : public Component {
@@ -242,13 +674,18 @@ public:
     Block() {};
     Block(float x, float y, const char *text, Color color, std::vector<Component*> comps, std::vector<Line*> connections);
     Block(const Block *block);
-    Block(std::ifstream& s, Component::Type type);
+    Block(Reader& s, Component::Type type);
+    Block(Reader& s, Component::Type type, Color color) : Component(s, type), color(color), refCounter(0) {}
     ~Block();
-    virtual void Calc(std::vector<Connector*>&) override;
+    void Defer(Reader& s);
+    void Load();
+    void ReadContents(Reader& s);
+    void SaveContents(std::ostream& s);
     virtual void Move(const Vector2& delta) override;
     virtual void Draw() override;
+    virtual void PlaceConnectors() override;
     virtual Connector *CheckEndpoints(const Vector2 &pos) override;
-    virtual void Save(std::ofstream&) override;
+    virtual void Save(std::ostream&) override;
 
     std::vector<Component*> comps;
     std::vector<Line*> connections;
@@ -258,27 +695,219 @@ public:
     int numInputs;
     int numOutputs;
     int refCounter;
+
+    // Library blocks keep their contents unparsed in the project data until first used
+    std::shared_ptr<const std::vector<char>> source;
+    size_t sourceOffset = 0;
+    size_t sourceSize = 0;
+    int sourceVersion = 0;
+    // Hash of its entry in the block library, 0 when unknown or edited since
+    uint64_t hash = 0;
+
+    // Components and lines of the block are allocated here, instances share it with their library block
+    std::shared_ptr<Arena> arena = std::make_shared<Arena>();
+};
+
+// Contents of a block kept in a library file shared between projects
+struct LibraryBlock {
+    std::shared_ptr<const std::vector<char>> data;
+    size_t offset;
+    size_t size;
+    int version;
 };
 
 class Line {
 public:
-    Connector* start;
-    Connector* end;
-    Line(Connector* start, Connector* end) : start(start), end(end) {}
+    ConnectorHandle start;
+    ConnectorHandle end;
+    // The input joins the net of the output, unless it has other drivers too
+    Line(Connector* start, Connector* end) : start(start), end(end) {
+        if (!end->resolved)
+            end->net = start->net;
+    }
 /*
     Line(std::ifstream& s) {
         start = new Connector(s);
         end = ;
     }
-    void Save(std::ofstream& s) {
+    void Save(std::ostream& s) {
         start->Save(s);
         end->Save(s);
     }
     */
 };
 
+using NetMap = std::unordered_map<const Connector*, int>;
+
+// The board compiled into flat lists of gates over net ids. Gates are ordered by level, so one run settles
+// every acyclic circuit, and within a level gates of one type and input count are evaluated together.
+// Block instances are expanded in place, the nets inside each of them are its own.
+class Engine {
+public:
+    ~Engine() { Clear(); }
+
+    void Compile(Block& board);
+    void Run();
+    void Clear();
+    // Constants are folded for the mode compiled in, switching it needs a compile too
+    bool Stale(const Block* board) const {
+        return dirty || board != this->board || Connector::nets.removed != compiledAt || Connector::nets.fourState != fourState;
+    }
+
+    bool dirty = true;
+    // Registers start as X on the next compile, for four-state mode
+    bool unknownRegisters = false;
+    // Each run is one tick, gates switch after their delay instead of everything settling at once
+    bool timed = false;
+    uint64_t time = 0;
+    // Static timing of the last compile: the longest path from an input to an output in ticks of gate delay,
+    // the components on it from the input on, each one with the block instances it is in from the board down,
+    // and the nets it goes through. Nets driven in loops have no timing, criticalLoop is set when an output
+    // depends on one.
+    int criticalDelay = 0;
+    bool criticalLoop = false;
+    std::vector<std::vector<const Component*>> criticalPath;
+    std::unordered_set<int> criticalNets;
+    std::unordered_set<int> loopNets;
+
+    // RAM of a block instance, which shares its components with the library block. Kept across compiles by
+    // the board and the components leading to the memory, with their indices as of the last compile.
+    struct InstanceMemory {
+        std::vector<int> indices;
+        std::string contents;
+        bool used = false;
+    };
+    std::map<std::vector<const Component*>, InstanceMemory> instanceMemories;
+    // Read with a project by indices from the board, taken over by the memory there when it is compiled
+    std::map<std::vector<int>, std::string> savedMemories;
+    const Block* savedBoard = nullptr;
+    // The memory's contents were replaced, its instances start over from them
+    void ForgetMemory(const Memory* memory);
+
+private:
+    struct Node {
+        Gate::Type type;
+        std::vector<int> ins;
+        int out;
+        // Index in macros for a macro, its outputs are the nets driven
+        int macro = -1;
+        // Wires made by the engine switch in the same tick, macros always do
+        int delay = 1;
+        // Index in owners of the components it was made for
+        int owner = -1;
+    };
+    struct Event {
+        int net;
+        int level;
+    };
+    // Larger than Gate::MAX_DELAY, so an event never lands in the slot being processed
+    static constexpr int WHEEL_SIZE = 256;
+    // Rounds of zero delay changes within one tick before it is cut short
+    static constexpr int MAX_ROUNDS = 1000;
+    // Pins of its gates one after another, numInputs inputs and then the output
+    struct Group {
+        Gate::Type type;
+        int numInputs;
+        std::vector<int> pins;
+        // Macros of one level run after its gates, one by one
+        std::vector<int> macros;
+    };
+    struct Port {
+        int net;
+        int width;
+    };
+    struct MacroOp {
+        Macro::Kind kind;
+        std::vector<Port> ins;
+        std::vector<Port> outs;
+        // Clock seen by the last run of a register or RAM
+        bool clock = false;
+        // Contents of a memory
+        std::string* data = nullptr;
+        int wordBytes = 0;
+    };
+
+    void AddComponents(Block& block, const NetMap* nets);
+    void AddInstance(Block& instance, const NetMap* outer);
+    void AddMacro(Macro& macro, const NetMap* nets);
+    void AddMemory(Memory& memory, const NetMap* nets);
+    void AddResolvers(Block& block, const NetMap* nets);
+    void Optimize();
+    void Sort(std::unordered_map<int, int>& drivers, std::vector<int>& order, std::vector<std::vector<int>>& fanout) const;
+    void Analyze();
+    static void RunMacro(MacroOp& op, NetState& nets);
+    void CompileTimed();
+    void RunTimed();
+    void Trigger(int net);
+    void Evaluate(int node);
+
+    std::vector<Node> nodes;
+    std::vector<Group> groups;
+    std::vector<MacroOp> macros;
+    // Nets no node drives anymore with the level they are held at: outputs folded to constants and X on what
+    // nothing observed depends on
+    std::vector<Event> fixed;
+    // Components from the board down to the one each node was made for
+    std::vector<std::vector<const Component*>> owners;
+    // Components from the board down to the one being compiled, and their indices
+    std::vector<const Component*> path;
+    std::vector<int> indices;
+
+    // Timed simulation: events of the next WHEEL_SIZE ticks in slots by time, the nodes reading each net,
+    // the level each gate's output was last scheduled to, and nets set from outside with their last level
+    std::vector<std::vector<Event>> wheel;
+    std::vector<Event> current;
+    std::unordered_map<int, std::vector<int>> fanout;
+    std::vector<int> projected;
+    std::vector<int> sources;
+    std::vector<int> sourceLevels;
+    std::vector<int> triggered;
+    std::vector<int> evaluating;
+    std::vector<bool> isTriggered;
+    // Nets made for the insides of block instances
+    std::vector<int> ownNets;
+    const Block* board = nullptr;
+    uint64_t compiledAt = 0;
+    bool fourState = false;
+};
+
 enum class MenuOption { CREATE, SAVE, CLEAR, CLOSE, NEW, LOAD };
 
+// Edits appended to the project's journal, each one mirrors a Symulator operation
+enum class JournalOp : unsigned char {
+    ADD_COMPONENT,
+    DELETE_COMPONENT,
+    MOVE_COMPONENT,
+    ADD_CONNECTION,
+    DELETE_CONNECTION,
+    DELETE_ALL,
+    SET_VALUE,
+    SET_SIGNED,
+    CREATE_BLOCK,
+    INSERT_COMPONENT,
+    DELETE_COMPONENTS,
+    SET_INPUTS,
+    SET_BUS,
+    SET_WORD,
+    SET_WIDTH,
+    SET_MEMORY,
+    SET_DELAY,
+    LOAD_MEMORY
+};
+
+// Journal record kept in memory, undo steps are made of these
+struct Edit {
+    JournalOp op;
+    std::string data;
+};
+
+// One user action on a block, with the records reverting it and the ones making it again
+struct UndoStep {
+    Block* target;
+    std::vector<Edit> undo;
+    std::vector<Edit> redo;
+};
+
 class MenuButton {
 public:
     const char *text;
@@ -388,6 +1017,8 @@ public:
     enum class State {
         ACTIVE,
         GATE_MOVING,
+        SELECTION_MOVING,
+        SELECTING,
         LINE_DRAWING,
         MENU
     };
@@ -417,20 +1048,52 @@ public:
     void DeleteComponent(Component* comp);
     void DeleteBlock(Block* comp);
     void DeleteAll();
+    void DeleteComponents(const std::vector<int>& indices);
+    void SetGateInputs(Gate* gate, int count);
+    void SetBus(Component* comp, bool bus);
+    void SetBusWidth(Splitter* splitter, int width);
+    void SetMacroWidth(Macro* macro, int width);
+    void SetMemory(Memory* memory, int addrWidth, int dataWidth, const std::string& contents);
+    void SetMemoryWidths(Memory* memory, int addrWidth, int dataWidth, const std::string& tail);
+    void SetFourState(bool on);
+    void SetTimed(bool on);
+
+    std::vector<int> SelectionIndices();
+    void DeleteSelection();
+    void CopySelection();
+    void Paste();
 
     void DrawComponentMenu();
     void DrawPanel();
     void DrawComponents();
     void DrawConnections();
+    bool OnCriticalPath(const Line* line) const;
+    bool InLoop(const Line* line) const;
 
     void MoveComponentMenu(float delta);
 
-    void ReadProjectData(std::ifstream&);
-    void WriteProjectData(std::ofstream&);
+    void ReadProjectData(Reader&);
+    bool WriteProjectData(std::ostream&);
     void LoadProject();
     void SaveProject();
+    void WriteSnapshot();
+    void FinishSave(bool wait);
     void ClearProject();
 
+    LibraryBlock* FindLibraryBlock(uint64_t hash);
+    bool SaveLibraryBlock(Block* libBlock, std::ostream& s);
+
+    bool OpenJournal(bool truncate, const std::string& records = {});
+    void Journal(JournalOp op, Block* target, const std::string& data = {});
+    bool ReplayJournal();
+    void ApplyJournal(JournalOp op, Block* target, Reader& s);
+
+    void Record(JournalOp op, const std::string& data, std::vector<Edit> undo);
+    void Record(std::vector<Edit> redo, std::vector<Edit> undo);
+    void ApplyEdits(Block* target, const std::vector<Edit>& edits);
+    void Undo();
+    void Redo();
+    void ClearHistory();
 
     void Update();
     void Draw();
@@ -446,6 +1109,13 @@ public:
     Component* movingComp;
     Connector* lineStart;
 
+    // Components of the current block picked with the rubber band
+    std::vector<Component*> selection;
+    Vector2 selectStart;
+    // Copied components saved as for ADD_COMPONENT, lines refer to them by their place in the copy
+    std::vector<std::string> clipboard;
+    std::vector<std::pair<CompIdx, CompIdx>> clipboardLines;
+
     MenuPanel menu;
     MainMenu mainMenu;
     float compMenuNextX;
@@ -453,6 +1123,32 @@ public:
     int numStdMenuElems;
     Dialog blockDialog;
     std::string name;
+    bool compress = false;
+
+    std::ofstream journal;
+    uint64_t journalSeq = 0;
+    int journalRecords = 0;
+
+    // Snapshot being written in the background and the journal records made meanwhile
+    std::thread saveThread;
+    std::atomic<bool> saveDone{false};
+    std::atomic<bool> saveOk{false};
+    std::string journalTail;
+    int tailRecords = 0;
+    double lastSave = 0;
+
+    // Edits that can be undone, newest at the back
+    std::vector<UndoStep> undoSteps;
+    std::vector<UndoStep> redoSteps;
+
+    Engine engine;
+    // The critical path is drawn over the board
+    bool showCritical = false;
+
+    // Library blocks by hash of their contents, kept across projects
+    std::unordered_map<uint64_t, LibraryBlock> libraries;
+    // Directory of the library files, shared by all projects
+    std::string libraryDir = "library";
 };
 
 } // namespace sym